@@ -0,0 +1,147 @@
+/*
+ * Time malloc/free pairs.
+ *
+ * Each round allocates BATCH objects and then frees them all, on one
+ * thread. The rounds are timed and the time is reported per pair.
+ * The same loop is run through malloc(), through a user heap and
+ * through the hmalloc_site_* API, and then on several threads at
+ * once.
+ *
+ *     make bench
+ *     HMALLOC_SITE_LAYOUT=site ./bench/pair [n_pairs]
+ *
+ * It only uses what hmalloc.h has had all along (except for the
+ * site macros, which are skipped where they don't exist), so it can
+ * be copied into an older checkout to compare against it.
+ */
+
+#include "../src/hmalloc.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BATCH       (64)
+#define N_THREADS   (4)
+#define DEFAULT_N   (2000000)
+
+enum {
+    PAIR_MALLOC,
+    PAIR_USER_HEAP,
+    PAIR_SITE_STRING,
+    PAIR_SITE_MACRO,
+};
+
+static const char *pair_names[] = {
+    "malloc",
+    "user heap",
+    "site (string)",
+    "site (macro)",
+};
+
+typedef struct {
+    int    kind;
+    size_t size;
+    long   n_pairs;
+    double ns_per_pair;
+} pair_run_t;
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void * pair_alloc(int kind, size_t size) {
+    switch (kind) {
+        case PAIR_USER_HEAP:   return hmalloc("bench", size);
+        case PAIR_SITE_STRING: return hmalloc_site_malloc("bench.site", size);
+#ifdef HMALLOC_SITE_MALLOC
+        case PAIR_SITE_MACRO:  return HMALLOC_SITE_MALLOC(size);
+#endif
+    }
+
+    return malloc(size);
+}
+
+static void pair_round(int kind, size_t size) {
+    void *ptrs[BATCH];
+    int   i;
+
+    for (i = 0; i < BATCH; i += 1)    { ptrs[i] = pair_alloc(kind, size); }
+    for (i = 0; i < BATCH; i += 1)    { free(ptrs[i]);                    }
+}
+
+static void * pair_run(void *arg) {
+    pair_run_t *run;
+    double      start;
+    long        n_rounds,
+                r;
+
+    run      = arg;
+    n_rounds = run->n_pairs / BATCH;
+
+    /* Warm up so that the first blocks aren't counted. */
+    pair_round(run->kind, run->size);
+
+    start = now_ns();
+
+    for (r = 0; r < n_rounds; r += 1) {
+        pair_round(run->kind, run->size);
+    }
+
+    run->ns_per_pair = (now_ns() - start) / (n_rounds * BATCH);
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 16, 512, 4000 };
+    pair_run_t          run,
+                        runs[N_THREADS];
+    pthread_t           threads[N_THREADS];
+    long                n_pairs;
+    int                 kind,
+                        s,
+                        t;
+
+    n_pairs = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_N;
+
+    if (n_pairs < BATCH)    { n_pairs = BATCH; }
+
+    for (kind = PAIR_MALLOC; kind <= PAIR_SITE_MACRO; kind += 1) {
+#ifndef HMALLOC_SITE_MALLOC
+        /* Older trees don't have site descriptors. */
+        if (kind == PAIR_SITE_MACRO)    { continue; }
+#endif
+
+        for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s += 1) {
+            run.kind    = kind;
+            run.size    = sizes[s];
+            run.n_pairs = n_pairs;
+
+            pair_run(&run);
+
+            printf("%-14s size %5zu: %6.1f ns per malloc+free pair\n",
+                   pair_names[kind], run.size, run.ns_per_pair);
+        }
+    }
+
+    for (t = 0; t < N_THREADS; t += 1) {
+        runs[t].kind    = PAIR_MALLOC;
+        runs[t].size    = 64;
+        runs[t].n_pairs = n_pairs;
+        pthread_create(&threads[t], NULL, pair_run, &runs[t]);
+    }
+
+    for (t = 0; t < N_THREADS; t += 1) {
+        pthread_join(threads[t], NULL);
+        printf("%-14s size %5d: %6.1f ns per malloc+free pair (thread %d of %d)\n",
+               pair_names[PAIR_MALLOC], 64, runs[t].ns_per_pair, t + 1, N_THREADS);
+    }
+
+    return 0;
+}
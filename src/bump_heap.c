@@ -0,0 +1,137 @@
+#include "internal.h"
+#include "bump_heap.h"
+#include "thread.h"
+#include "page_map.h"
+
+internal heap_t * bump_heap_new(void) {
+    heap_t *heap;
+
+    heap = icalloc(1, sizeof(heap_t));
+
+    if (unlikely(heap == NULL))    { return NULL; }
+
+    heap_make(heap);
+    heap->__meta.flags |= HEAP_BUMP;
+
+    LOG("hid %d is a bump heap\n", heap->__meta.hid);
+
+    return heap;
+}
+
+internal bblock_header_t * bump_heap_new_bblock(heap_t *heap, u64 n_bytes) {
+    block_header_t  *block;
+    bblock_header_t *bblock;
+    u64              n_pages;
+
+    n_pages = DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size;
+
+    /* As with cblocks, big requests get exactly the pages they need. */
+    if (DEFAULT_BLOCK_SIZE - sizeof(block_header_t) - sizeof(u64) < n_bytes) {
+        n_pages = ALIGN(n_bytes + sizeof(block_header_t) + sizeof(u64), system_info.page_size)
+                    >> system_info.log_2_page_size;
+    }
+
+    block = heap_get_block_pages(heap, n_pages);
+
+    /* Only rewinds fill in a bump heap's spare block. */
+    heap->wants_spare = 0;
+
+    if (unlikely(block == NULL))    { return NULL; }
+
+    block->heap__meta  = heap->__meta;
+    block->heap        = heap;
+    block->provider    = heap->provider;
+    block->tid         = get_this_tid();
+    block->block_kind  = BLOCK_KIND_BBLOCK;
+    bblock             = &(block->b);
+    bblock->top        = ((void*)block) + sizeof(block_header_t);
+    bblock->end        = ((void*)block) + (n_pages << system_info.log_2_page_size);
+
+    if (unlikely(page_map_set(block, n_pages << system_info.log_2_page_size, block) != 0)) {
+        heap->provider->free_pages(heap->provider->ctx, block, n_pages << system_info.log_2_page_size);
+        return NULL;
+    }
+
+    bblock->prev       = heap->bblocks_tail;
+    heap->bblocks_tail = bblock;
+
+    return bblock;
+}
+
+internal void * bump_heap_alloc(heap_t *heap, u64 n_bytes) {
+    bblock_header_t *bblock;
+    void            *addr;
+
+    if (n_bytes == 0) {
+        return NULL;
+    }
+
+    n_bytes = ALIGN(n_bytes, 8);
+    bblock  = heap->bblocks_tail;
+
+    if (unlikely(bblock == NULL
+    ||  (u64)(bblock->end - bblock->top) < n_bytes + sizeof(u64))) {
+        /*
+         * Whatever is left at the end of the old block is wasted
+         * until it is rewound.
+         */
+        bblock = bump_heap_new_bblock(heap, n_bytes);
+
+        if (unlikely(bblock == NULL))    { return NULL; }
+    }
+
+    addr                  = bblock->top + sizeof(u64);
+    BUMP_ALLOC_SIZE(addr) = n_bytes;
+    bblock->top           = addr + n_bytes;
+
+    return addr;
+}
+
+/*
+ * Drop every block newer than bblock and move bblock's top back to
+ * top. A NULL bblock empties the heap.
+ */
+internal void bump_heap_rewind(heap_t *heap, bblock_header_t *bblock, void *top) {
+    bblock_header_t    *cursor;
+    deferred_release_t *releases;
+
+    while ((cursor = heap->bblocks_tail) != NULL && cursor != bblock) {
+        heap->bblocks_tail = cursor->prev;
+
+        if (heap->spare_block == NULL
+        &&  cursor->end - (void*)cursor == DEFAULT_BLOCK_SIZE) {
+            page_map_clear(cursor, DEFAULT_BLOCK_SIZE);
+            heap->spare_block = cursor;
+        } else {
+            heap_defer_release(heap, cursor, cursor->end);
+        }
+    }
+
+    ASSERT(cursor == bblock, "rewinding a bump heap to a mark that it doesn't have");
+
+    if (bblock != NULL) {
+        ASSERT(top >= ((void*)bblock) + sizeof(block_header_t) && top <= bblock->top,
+               "bad bump heap mark");
+        bblock->top = top;
+    }
+
+    releases                = heap->deferred_releases;
+    heap->deferred_releases = NULL;
+
+    heap_finish_unlocked(heap, releases, 0);
+}
+
+internal void bump_heap_free(heap_t *heap) {
+    hmalloc_page_provider_t *provider;
+
+    bump_heap_rewind(heap, NULL, NULL);
+
+    if (heap->spare_block != NULL) {
+        provider = heap->provider;
+        provider->free_pages(provider->ctx, heap->spare_block, DEFAULT_BLOCK_SIZE);
+    }
+
+    LOG("freed bump heap (hid = %d)\n", heap->__meta.hid);
+
+    ifree(heap);
+}
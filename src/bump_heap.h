@@ -0,0 +1,35 @@
+#ifndef __BUMP_HEAP_H__
+#define __BUMP_HEAP_H__
+
+#include "internal.h"
+#include "heap.h"
+
+/*
+ * Bump heaps (arenas in the public interface).
+ *
+ * Allocating from a bump heap only moves the top of its newest
+ * block along, and freeing its memory does nothing. Memory comes back
+ * all at once: hmalloc_arena_rewind() drops everything that was
+ * allocated after a mark, and resetting or destroying the heap drops
+ * everything.
+ *
+ * Blocks are marked with HEAP_BUMP, so hmalloc_free() knows to leave
+ * them alone without any help from the caller. The heap keeps them
+ * newest first (bblocks_tail and then prev), so a mark is just the
+ * newest block and its top. A rewind keeps one of the standard sized
+ * blocks that it drops as the heap's spare block, so that a
+ * parse-then-rewind loop doesn't go back to the page provider every
+ * time around.
+ *
+ * Bump heaps aren't locked and aren't in the user heap directory.
+ * Only one thread may use a bump heap at a time.
+ */
+
+#define BUMP_ALLOC_SIZE(addr) (*(((u64*)(addr)) - 1))
+
+internal heap_t * bump_heap_new(void);
+internal void * bump_heap_alloc(heap_t *heap, u64 n_bytes);
+internal void bump_heap_rewind(heap_t *heap, bblock_header_t *bblock, void *top);
+internal void bump_heap_free(heap_t *heap);
+
+#endif
@@ -0,0 +1,187 @@
+#include "internal.h"
+#include "epoch.h"
+#include "thread.h"
+
+internal epoch_local_t * get_this_epoch(void) {
+    /* Make sure that this thread has its own slot. */
+    get_this_thread();
+
+    return &local_own_thr->epoch;
+}
+
+/*
+ * Move the global epoch forward if every thread that is in a critical
+ * section has already seen the current one.
+ * Returns the global epoch as of when we're done.
+ */
+internal u64 epoch_try_advance(void) {
+    thread_data_t *thr;
+    u64            epoch,
+                   active;
+    hm_tid_t       n_slots,
+                   tid;
+
+    /*
+     * Pairs with the fence in hmalloc_epoch_enter(). Whatever the
+     * caller did to unlink the memory it retired has to be visible
+     * before we read the announcements. Otherwise a reader whose
+     * announcement we miss could still find that memory.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    epoch   = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    n_slots = __atomic_load_n(&thread_registry.n_slots, __ATOMIC_ACQUIRE);
+
+    for (tid = 0; tid < n_slots; tid += 1) {
+        thr = thread_data_for_tid(tid);
+
+        if (thr == NULL)    { continue; }
+
+        active = __atomic_load_n(&thr->epoch.active, __ATOMIC_ACQUIRE);
+
+        if (EPOCH_IS_ACTIVE(active) && EPOCH_OF(active) != epoch) {
+            return epoch;
+        }
+    }
+
+    /* If this fails, someone else moved it for us. */
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1,
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+}
+
+internal void epoch_free_bag(epoch_local_t *ep, epoch_batch_t *batch) {
+    epoch_batch_t *next;
+
+    for (; batch != NULL; batch = next) {
+        next = batch->next;
+
+        free_addrs(batch->addrs, batch->n_addrs);
+
+        if (ep->spare_batch == NULL) {
+            ep->spare_batch = batch;
+        } else {
+            ifree(batch);
+        }
+    }
+}
+
+/* Free every bag whose epoch is at least two behind epoch. */
+internal void epoch_reclaim(epoch_local_t *ep, u64 epoch) {
+    epoch_batch_t *batch;
+    u32            i;
+
+    for (i = 0; i < EPOCH_N_BAGS; i += 1) {
+        if (ep->bags[i] == NULL
+        ||  ep->bag_epochs[i] + 2 > epoch) {
+            continue;
+        }
+
+        batch       = ep->bags[i];
+        ep->bags[i] = NULL;
+
+        epoch_free_bag(ep, batch);
+    }
+}
+
+/*
+ * Called for a slot that is being orphaned. A thread that exits in a
+ * critical section must not hold the epoch back forever.
+ * Whatever can't be freed yet stays in the bags for the slot's next
+ * owner.
+ */
+internal void epoch_thread_exit(epoch_local_t *ep) {
+    ep->nesting = 0;
+    __atomic_store_n(&ep->active, 0, __ATOMIC_RELEASE);
+
+    if (ep->bags[0] != NULL
+    ||  ep->bags[1] != NULL
+    ||  ep->bags[2] != NULL) {
+        epoch_reclaim(ep, epoch_try_advance());
+    }
+}
+
+external void hmalloc_epoch_enter(void) {
+    epoch_local_t *ep;
+
+    ep = get_this_epoch();
+
+    if (ep->nesting++ > 0)    { return; }
+
+    __atomic_store_n(&ep->active,
+                     EPOCH_ACTIVE(__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE)),
+                     __ATOMIC_RELAXED);
+
+    /*
+     * The announcement has to be visible before we load any of the
+     * pointers that it protects.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+external void hmalloc_epoch_exit(void) {
+    epoch_local_t *ep;
+
+    ep = get_this_epoch();
+
+    ASSERT(ep->nesting > 0, "hmalloc_epoch_exit() without hmalloc_epoch_enter()");
+
+    if (--ep->nesting > 0)    { return; }
+
+    __atomic_store_n(&ep->active, 0, __ATOMIC_RELEASE);
+}
+
+external void hmalloc_free_deferred(void *addr) {
+    epoch_local_t *ep;
+    epoch_batch_t *batch;
+    u64            epoch;
+    u32            bag;
+
+    if (unlikely(addr == NULL))    { return; }
+
+    ep    = get_this_epoch();
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    bag   = epoch % EPOCH_N_BAGS;
+
+    if (ep->bag_epochs[bag] != epoch) {
+        /*
+         * The bag is from EPOCH_N_BAGS or more epochs ago, which
+         * is long enough.
+         */
+        batch               = ep->bags[bag];
+        ep->bags[bag]       = NULL;
+        ep->bag_epochs[bag] = epoch;
+
+        epoch_free_bag(ep, batch);
+    }
+
+    batch = ep->bags[bag];
+
+    if (batch == NULL || batch->n_addrs == EPOCH_BATCH_LEN) {
+        if (ep->spare_batch != NULL) {
+            batch           = ep->spare_batch;
+            ep->spare_batch = NULL;
+        } else {
+            batch = imalloc(sizeof(epoch_batch_t));
+
+            if (unlikely(batch == NULL)) {
+                /* We can't free it yet and we can't remember it. */
+                LOG("out of memory for deferred frees -- leaking %p\n", addr);
+                return;
+            }
+        }
+
+        batch->next    = ep->bags[bag];
+        batch->n_addrs = 0;
+        ep->bags[bag]  = batch;
+    }
+
+    batch->addrs[batch->n_addrs] = addr;
+    batch->n_addrs              += 1;
+
+    if (unlikely(++ep->n_retired >= EPOCH_ADVANCE_INTERVAL)) {
+        ep->n_retired = 0;
+        epoch_reclaim(ep, epoch_try_advance());
+    }
+}
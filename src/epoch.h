@@ -0,0 +1,58 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "internal.h"
+
+/*
+ * Epoch-based reclamation for hmalloc_free_deferred().
+ *
+ * There is one global epoch. A thread that is between
+ * hmalloc_epoch_enter() and hmalloc_epoch_exit() publishes the epoch
+ * it saw when it entered. The global epoch only moves forward when
+ * every thread in a critical section has seen the current one, so
+ * once it has moved twice past the epoch that something was retired
+ * in, no thread can still be holding a reference from before the
+ * retirement and the memory can be freed.
+ *
+ * Retired addresses are kept in one of EPOCH_N_BAGS per-thread bags
+ * (by epoch, mod EPOCH_N_BAGS). Readers may still be looking at
+ * retired memory, so it can't be used to link it up; a bag is a list
+ * of batches of addresses instead. When a bag's epoch is old enough,
+ * each batch goes back to its heaps with free_addrs(), which only
+ * takes each heap once per run of frees into it.
+ * Every EPOCH_ADVANCE_INTERVAL retirements the thread tries to move
+ * the global epoch along.
+ *
+ * The state lives in the slot of the OS thread, not in a context, so
+ * critical sections must not span hmalloc_context_switch().
+ */
+
+#define EPOCH_N_BAGS           (3)
+#define EPOCH_ADVANCE_INTERVAL (64)
+#define EPOCH_BATCH_LEN        (254)
+
+/* (epoch << 1) | 1 while in a critical section, 0 otherwise. */
+#define EPOCH_ACTIVE(e)        (((e) << 1ULL) | 1ULL)
+#define EPOCH_IS_ACTIVE(a)     ((a) & 1ULL)
+#define EPOCH_OF(a)            ((a) >> 1ULL)
+
+typedef struct epoch_batch {
+    struct epoch_batch *next;
+    u64                 n_addrs;
+    void               *addrs[EPOCH_BATCH_LEN];
+} epoch_batch_t;
+
+typedef struct {
+    u64            active;
+    u32            nesting;
+    u32            n_retired;
+    epoch_batch_t *bags[EPOCH_N_BAGS];
+    u64            bag_epochs[EPOCH_N_BAGS];
+    epoch_batch_t *spare_batch;
+} epoch_local_t;
+
+internal u64 global_epoch;
+
+internal void epoch_thread_exit(epoch_local_t *ep);
+
+#endif
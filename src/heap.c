@@ -3,30 +3,329 @@
 #include "os.h"
 #include "profile.h"
 #include "thread.h"
+#include "prefetch.h"
+#include "page_map.h"
+#include "init.h"
+#include "small_heap.h"
 
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
 
+/*
+ * Take a block of n_pages from the blocks that the heap's attributes
+ * said to keep. Called with the heap locked (or by the owner), so
+ * this is the only thing taking blocks off the list; others may be
+ * pushing onto it, so the list is taken whole and whatever isn't
+ * used is put back.
+ */
+internal void * heap_take_retained_block(heap_t *heap, u64 n_pages) {
+    deferred_release_t  *list,
+                        *found,
+                        *tail,
+                        *head,
+                       **prev;
+
+    if (likely(__atomic_load_n(&heap->retained, __ATOMIC_RELAXED) == NULL)) {
+        return NULL;
+    }
+
+    list  = __atomic_exchange_n(&heap->retained, NULL, __ATOMIC_ACQUIRE);
+    found = NULL;
+
+    for (prev = &list; *prev != NULL; prev = &(*prev)->next) {
+        if ((*prev)->n_pages == n_pages) {
+            found = *prev;
+            *prev = found->next;
+            break;
+        }
+    }
+
+    if (list != NULL) {
+        for (tail = list; tail->next != NULL; tail = tail->next);
+
+        head = __atomic_load_n(&heap->retained, __ATOMIC_RELAXED);
+        do {
+            tail->next = head;
+        } while (!__atomic_compare_exchange_n(&heap->retained, &head, list,
+                                              0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    if (found == NULL)    { return NULL; }
+
+    __atomic_sub_fetch(&heap->n_retained, 1, __ATOMIC_RELAXED);
+
+    /* It was purged when it was kept. */
+    if ((heap->attr.flags & (HMALLOC_HEAP_PREFAULT | HMALLOC_HEAP_MLOCK)) == HMALLOC_HEAP_PREFAULT) {
+        heap->provider->commit(heap->provider->ctx, found, n_pages << system_info.log_2_page_size);
+    }
+
+    /* Don't leave the old queue entry lying around in the header. */
+    memset(found, 0, sizeof(*found));
+
+    return found;
+}
+
+/* Apply the heap's page attributes to a block that just came from outside the heap. */
+internal void heap_apply_page_attr(heap_t *heap, void *block, u64 n_bytes) {
+    os_apply_page_attr(block, n_bytes, &heap->attr);
+
+    if ((heap->attr.flags & (HMALLOC_HEAP_PREFAULT | HMALLOC_HEAP_MLOCK)) == HMALLOC_HEAP_PREFAULT) {
+        heap->provider->commit(heap->provider->ctx, block, n_bytes);
+    }
+}
+
+/*
+ * Called with the heap locked.
+ * Standard sized blocks should come from the heap's spare block
+ * (installed after some earlier unlock) or from the prefetcher.
+ * Anything else is a trip to the page provider while holding the
+ * lock, which we count.
+ * Thread heaps are never locked, so they don't keep a spare; it
+ * would only double their footprint.
+ * Blocks that the heap kept and its spare already have the heap's
+ * page attributes, which were applied unlocked. Anything else (odd
+ * sizes, or a spare that hasn't been replaced yet) gets them here.
+ */
+internal void * heap_get_block_pages(heap_t *heap, u64 n_pages) {
+    hmalloc_page_provider_t *provider;
+    void                    *block;
+    u64                      alignment;
+
+    if (unlikely(heap->retained != NULL)
+    &&  (block = heap_take_retained_block(heap, n_pages))) {
+        return block;
+    }
+
+    provider  = heap->provider;
+    alignment = system_info.page_size;
+
+    if (n_pages == (DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size)) {
+        alignment = BLOCK_ALIGNMENT;
+
+        if (!(heap->__meta.flags & HEAP_THREAD)) {
+            /*
+             * Whether we use it or not, ask for the spare to be
+             * replaced once the lock is dropped.
+             */
+            heap->wants_spare = 1;
+
+            if ((block = __atomic_exchange_n(&heap->spare_block, NULL, __ATOMIC_ACQUIRE))) {
+                return block;
+            }
+        }
+
+        /*
+         * The prefetcher only deals in mmap()ed blocks, and its
+         * blocks are already faulted in wherever the prefetch
+         * thread ran, too late for page attributes.
+         */
+        if (provider == &os_page_provider
+        &&  !HEAP_HAS_PAGE_ATTR(heap)
+        &&  (block = prefetch_take_block())) {
+            goto out;
+        }
+    }
+
+    heap->n_os_allocs += 1;
+
+    block = provider->alloc_pages(provider->ctx,
+                                  n_pages << system_info.log_2_page_size,
+                                  alignment);
+
+out:;
+    if (unlikely(HEAP_HAS_PAGE_ATTR(heap)) && block != NULL) {
+        heap_apply_page_attr(heap, block, n_pages << system_info.log_2_page_size);
+    }
+
+    return block;
+}
+
+/*
+ * Called with the heap locked.
+ * Queue a block that we're done with. It will be given back to
+ * its provider in heap_finish_unlocked().
+ */
+internal void heap_defer_release(heap_t *heap, void *block, void *end) {
+    deferred_release_t      *release;
+    hmalloc_page_provider_t *provider;
+
+    provider = ((block_header_t*)block)->provider;
+
+    /* Nothing should find this block from here on. */
+    page_map_clear(block, end - block);
+
+    release           = block;
+    release->n_pages  = (end - block) >> system_info.log_2_page_size;
+    release->provider = provider;
+    release->next     = heap->deferred_releases;
+
+    heap->deferred_releases = release;
+}
+
+internal void heap_refill_spare(heap_t *heap) {
+    hmalloc_page_provider_t *provider;
+    void                    *block;
+
+    if (__atomic_load_n(&heap->spare_block, __ATOMIC_RELAXED) != NULL) {
+        return;
+    }
+
+    provider = heap->provider;
+    block    = NULL;
+
+    if (provider == &os_page_provider && !HEAP_HAS_PAGE_ATTR(heap)) {
+        block = prefetch_take_block();
+    }
+
+    if (block == NULL) {
+        block = provider->alloc_pages(provider->ctx, DEFAULT_BLOCK_SIZE, BLOCK_ALIGNMENT);
+        if (unlikely(block == NULL))    { return; }
+    }
+
+    /* Get the system calls out of the way while we're unlocked. */
+    if (unlikely(HEAP_HAS_PAGE_ATTR(heap))) {
+        heap_apply_page_attr(heap, block, DEFAULT_BLOCK_SIZE);
+    }
+
+    /*
+     * Someone else may have refilled it while we were mapping.
+     * If so, this block isn't needed.
+     */
+    if (!__sync_bool_compare_and_swap(&heap->spare_block, NULL, block)) {
+        provider->free_pages(provider->ctx, block, DEFAULT_BLOCK_SIZE);
+    }
+}
+
+/*
+ * Keep a block that is being released if the heap's attributes say
+ * to. Kept blocks have to look like fresh ones when they're reused,
+ * so they're purged, or cleared by hand when the provider's purge
+ * might not zero them or the heap is mlock()ed (and purging would
+ * fault them back in later anyway).
+ * Returns whether the block was kept.
+ */
+internal int heap_retain_block(heap_t *heap, deferred_release_t *release) {
+    hmalloc_page_provider_t *provider;
+    deferred_release_t      *head;
+    u64                      n_pages,
+                             n_bytes;
+
+    if (likely(heap->attr.max_retained == 0))    { return 0; }
+
+    if (__atomic_fetch_add(&heap->n_retained, 1, __ATOMIC_RELAXED) >= heap->attr.max_retained) {
+        __atomic_sub_fetch(&heap->n_retained, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    provider = release->provider;
+    n_pages  = release->n_pages;
+    n_bytes  = n_pages << system_info.log_2_page_size;
+
+    if (provider != &os_page_provider
+    ||  (heap->attr.flags & HMALLOC_HEAP_MLOCK)
+    ||  provider->purge(provider->ctx, release, n_bytes) != 0) {
+        memset(release, 0, n_bytes);
+    }
+
+    release->n_pages  = n_pages;
+    release->provider = provider;
+
+    head = __atomic_load_n(&heap->retained, __ATOMIC_RELAXED);
+    do {
+        release->next = head;
+    } while (!__atomic_compare_exchange_n(&heap->retained, &head, release,
+                                          0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+/*
+ * The work that heap operations hand back to be done after
+ * the heap's lock has been released: returning queued blocks to
+ * their providers (or keeping them) and replacing the spare block.
+ */
+internal void heap_finish_unlocked(heap_t *heap, deferred_release_t *releases, u32 wants_spare) {
+    deferred_release_t      *next;
+    hmalloc_page_provider_t *provider;
+    u64                      n_pages;
+
+    while (releases != NULL) {
+        next     = releases->next;
+        provider = releases->provider;
+        n_pages  = releases->n_pages;
+
+        if (unlikely(heap_retain_block(heap, releases))) {
+            releases = next;
+            continue;
+        }
+
+        provider->free_pages(provider->ctx, releases, n_pages << system_info.log_2_page_size);
+
+        releases = next;
+    }
+
+    if (wants_spare) {
+        heap_refill_spare(heap);
+    }
+}
+
 internal cblock_header_t * heap_new_cblock(heap_t *heap, u64 n_bytes) {
-    u64              n_pages;
-    u64              avail;
-    block_header_t  *block;
-    cblock_header_t *cblock;
-    chunk_header_t  *chunk;
+    u64                      n_pages;
+    u64                      avail;
+    block_header_t          *block;
+    cblock_header_t         *cblock;
+    chunk_header_t          *chunk;
+    hmalloc_page_provider_t *provider;
 
     ASSERT(IS_ALIGNED(DEFAULT_BLOCK_SIZE, system_info.page_size), "cblock size isn't aligned to page size");
-    n_pages = DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size;
+    n_pages  = SMALL_HEAP_SLICE_SIZE >> system_info.log_2_page_size;
+    provider = heap->provider;
+    block    = NULL;
+
+    /* Small heaps use a slice of a shared block if it's big enough. */
+    if (heap->small_slices_left > 0
+    &&  LARGEST_CHUNK_IN_EMPTY_N_PAGE_BLOCK(n_pages) >= n_bytes) {
+        block = small_heap_provider.alloc_pages(small_heap_provider.ctx,
+                                                SMALL_HEAP_SLICE_SIZE,
+                                                system_info.page_size);
+
+        if (likely(block != NULL)) {
+            provider                 = &small_heap_provider;
+            heap->small_slices_left -= 1;
+
+            if (heap->small_slices_left == 0) {
+                LOG("hid %d has used up its small heap slices -- promoting it\n", heap->__meta.hid);
+            }
+        }
+    }
+
+    if (block == NULL) {
+        n_pages = DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size;
 
-    while ((avail = LARGEST_CHUNK_IN_EMPTY_N_PAGE_BLOCK(n_pages)) < n_bytes) {
-        n_pages <<= 1;
+        /*
+         * Blocks don't need to be any particular size, so give
+         * requests that don't fit in a standard block exactly the
+         * pages they need.
+         */
+        if (LARGEST_CHUNK_IN_EMPTY_N_PAGE_BLOCK(n_pages) < n_bytes) {
+            n_pages = ALIGN(n_bytes + sizeof(block_header_t) + sizeof(chunk_header_t), system_info.page_size)
+                        >> system_info.log_2_page_size;
+        }
+
+        block = heap_get_block_pages(heap, n_pages);
+
+        if (unlikely(block == NULL))    { return NULL; }
     }
 
+    avail = LARGEST_CHUNK_IN_EMPTY_N_PAGE_BLOCK(n_pages);
+
     ASSERT(n_pages > 0, "n_pages is zero");
     ASSERT(IS_ALIGNED(avail, 8), "cblock memory isn't aligned properly");
 
-    block             = get_pages_from_os(n_pages, DEFAULT_BLOCK_SIZE);
     block->heap__meta = heap->__meta;
+    block->heap       = heap;
+    block->provider   = provider;
     block->tid        = get_this_tid();
     block->block_kind = BLOCK_KIND_CBLOCK;
     cblock            = &(block->c);
@@ -34,7 +333,12 @@ internal cblock_header_t * heap_new_cblock(heap_t *heap, u64 n_bytes) {
     cblock->prev      = NULL;
 
     ASSERT((void*)cblock->end > (void*)cblock, "cblock->end wasn't set correctly");
-    ASSERT(IS_ALIGNED(cblock, DEFAULT_BLOCK_SIZE), "cblock isn't aligned");
+    ASSERT(avail >= n_bytes, "cblock is too small");
+
+    if (unlikely(page_map_set(block, n_pages << system_info.log_2_page_size, block) != 0)) {
+        heap_defer_release(heap, (void*)block, cblock->end);
+        return NULL;
+    }
 
     /* Create the first and only chunk in the cblock. */
     chunk = CBLOCK_FIRST_CHUNK(cblock);
@@ -71,8 +375,8 @@ internal void heap_remove_cblock(heap_t *heap, cblock_header_t *cblock) {
     }
 }
 
-internal void release_cblock(cblock_header_t *cblock) {
-    release_pages_to_os((void*)cblock, ((cblock->end - ((void*)cblock)) >> system_info.log_2_page_size));
+internal void release_cblock(heap_t *heap, cblock_header_t *cblock) {
+    heap_defer_release(heap, (void*)cblock, cblock->end);
 }
 
 internal void heap_add_cblock(heap_t *heap, cblock_header_t *cblock) {
@@ -95,8 +399,13 @@ internal sblock_header_t * heap_new_sblock(heap_t *heap) {
     ASSERT(IS_ALIGNED(DEFAULT_BLOCK_SIZE, system_info.page_size), "cblock size isn't aligned to page size");
     n_pages = DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size;
 
-    block                              = get_pages_from_os(n_pages, DEFAULT_BLOCK_SIZE);
+    block                              = heap_get_block_pages(heap, n_pages);
+
+    if (unlikely(block == NULL))    { return NULL; }
+
     block->heap__meta                  = heap->__meta;
+    block->heap                        = heap;
+    block->provider                    = heap->provider;
     block->tid                         = get_this_tid();
     block->block_kind                  = BLOCK_KIND_SBLOCK;
     sblock                             = &(block->s);
@@ -105,9 +414,16 @@ internal sblock_header_t * heap_new_sblock(heap_t *heap) {
     sblock->prev                       = NULL;
     sblock->n_empty_regions            = 63;
 
+    ASSERT(IS_ALIGNED(sblock, BLOCK_ALIGNMENT), "sblock isn't aligned");
+
+    if (unlikely(page_map_set(block, n_pages << system_info.log_2_page_size, block) != 0)) {
+        heap_defer_release(heap, (void*)block, sblock->end);
+        return NULL;
+    }
+
     /*
-     * If get_pages_from_os() is implemented in terms of mmap(), which
-     * it is, then our memory is zeroed for us.
+     * Page providers must give us zeroed memory. Prefetched blocks
+     * come from mmap() and are only ever prefaulted with zeros.
      * We are done as far as initialization is concerned.
      */
 
@@ -136,8 +452,8 @@ internal void heap_remove_sblock(heap_t *heap, sblock_header_t *sblock) {
     }
 }
 
-internal void release_sblock(sblock_header_t *sblock) {
-    release_pages_to_os((void*)sblock, ((sblock->end - ((void*)sblock)) >> system_info.log_2_page_size));
+internal void release_sblock(heap_t *heap, sblock_header_t *sblock) {
+    heap_defer_release(heap, (void*)sblock, sblock->end);
 }
 
 internal void heap_add_sblock(heap_t *heap, sblock_header_t *sblock) {
@@ -156,17 +472,38 @@ internal void heap_add_sblock(heap_t *heap, sblock_header_t *sblock) {
 internal void heap_make(heap_t *heap) {
     heap->cblocks_head = heap->cblocks_tail = NULL;
     heap->big_chunk_cblocks_tail            = NULL;
+    heap->big_chunk_cblocks_live            = NULL;
 
 #ifdef HMALLOC_USE_SBLOCKS
     heap->sblocks_head = heap->sblocks_tail = NULL;
 #endif
+    heap->oblocks_head = heap->oblocks_tail = NULL;
+    heap->bblocks_tail                      = NULL;
+
+    heap->provider          = default_page_provider;
+    heap->spare_block       = NULL;
+    heap->deferred_releases = NULL;
+    heap->remote_frees        = NULL;
+    heap->remote_oblock_frees = NULL;
+    heap->incoming_blocks   = NULL;
+    heap->n_os_allocs       = 0;
+    heap->wants_spare       = 0;
+    heap->use_oblocks       = hmalloc_use_oblocks;
+    heap->retained          = NULL;
+    heap->n_retained        = 0;
+    heap->small_slices_left = 0;
+
+    heap->attr.flags        = 0;
+    heap->attr.numa_node    = -1;
+    heap->attr.max_retained = 0;
 
     heap->__meta.handle = NULL;
     heap->__meta.tid    = 0;
     heap->__meta.hid    = __sync_fetch_and_add(&hid_counter, 1);
     heap->__meta.flags  = 0;
+    heap->parent        = NULL;
 
-    pthread_mutex_init(&heap->mtx, NULL);
+    lock_init(&heap->lock);
 
     LOG("Created a new heap (hid = %d)\n", heap->__meta.hid);
 }
@@ -409,6 +746,9 @@ internal void * heap_alloc_from_sblocks(heap_t *heap, u64 n_bytes) {
 
     if (mem == NULL) {
         sblock = heap_new_sblock(heap);
+
+        if (unlikely(sblock == NULL))    { return NULL; }
+
         heap_add_sblock(heap, sblock);
         mem = sblock_get_slot_if_free(sblock);
     }
@@ -421,12 +761,261 @@ internal void * heap_alloc_from_sblocks(heap_t *heap, u64 n_bytes) {
 
 #endif
 
-internal void heap_free_big_chunk(heap_t *heap, chunk_header_t *big_chunk) {
+internal oblock_header_t * heap_new_oblock(heap_t *heap) {
+    block_header_t  *block;
+    oblock_header_t *oblock;
+    u64              n_pages,
+                     first_past_end;
+
+    n_pages = DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size;
+
+    block = heap_get_block_pages(heap, n_pages);
+
+    if (unlikely(block == NULL))    { return NULL; }
+
+    block->heap__meta       = heap->__meta;
+    block->heap             = heap;
+    block->provider         = heap->provider;
+    block->tid              = get_this_tid();
+    block->block_kind       = BLOCK_KIND_OBLOCK;
+    oblock                  = &(block->o);
+    oblock->meta            = ((void*)block) + sizeof(block_header_t);
+    oblock->data            = ((void*)block) + OBLOCK_DATA_OFFSET;
+    oblock->end             = ((void*)block) + (n_pages << system_info.log_2_page_size);
+    oblock->prev            = NULL;
+    oblock->n_granules      = (oblock->end - oblock->data) / OBLOCK_GRANULE_SIZE;
+    oblock->n_free_granules = oblock->n_granules;
+
+    ASSERT(oblock->n_granules > 0, "oblock has no room for data");
+
+    /*
+     * The metadata is zeroed by the provider, so everything is free.
+     * Mark the bits past the last granule as taken so that searches
+     * never have to check for the end of the block.
+     */
+    first_past_end = oblock->n_granules;
+    while (first_past_end < OBLOCK_MAX_GRANULES) {
+        oblock->meta->taken[first_past_end >> 6ULL] |= 1ULL << (first_past_end & 63ULL);
+        first_past_end += 1;
+    }
+
+    if (unlikely(page_map_set(block, n_pages << system_info.log_2_page_size, block) != 0)) {
+        heap_defer_release(heap, (void*)block, oblock->end);
+        return NULL;
+    }
+
+    return oblock;
+}
+
+internal void heap_remove_oblock(heap_t *heap, oblock_header_t *oblock) {
+    oblock_header_t *oblock_cursor;
+
+    if (oblock == heap->oblocks_head && oblock == heap->oblocks_tail) {
+        heap->oblocks_head = heap->oblocks_tail = NULL;
+    } else if (oblock == heap->oblocks_tail) {
+        heap->oblocks_tail = heap->oblocks_tail->prev;
+    } else {
+        oblock_cursor = heap->oblocks_tail;
+
+        while (oblock_cursor->prev != oblock) {
+            oblock_cursor = oblock_cursor->prev;
+        }
+
+        oblock_cursor->prev = oblock->prev;
+
+        if (oblock == heap->oblocks_head) {
+            heap->oblocks_head = oblock_cursor;
+        }
+    }
+}
+
+internal void release_oblock(heap_t *heap, oblock_header_t *oblock) {
+    heap_defer_release(heap, (void*)oblock, oblock->end);
+}
+
+internal void heap_add_oblock(heap_t *heap, oblock_header_t *oblock) {
+    if (heap->oblocks_head == NULL) {
+        ASSERT(heap->oblocks_tail == NULL, "oblock tail but no oblock head");
+        heap->oblocks_head = heap->oblocks_tail = oblock;
+    } else {
+        oblock->prev       = heap->oblocks_tail;
+        heap->oblocks_tail = oblock;
+    }
+}
+
+internal void oblock_set_taken(oblock_header_t *oblock, u64 granule, u64 n, int taken) {
+    u64 *word,
+         mask,
+         n_in_word;
+
+    while (n > 0) {
+        word      = oblock->meta->taken + (granule >> 6ULL);
+        n_in_word = MIN(n, 64ULL - (granule & 63ULL));
+        mask      = (n_in_word == 64ULL ? ALL_SLOTS_TAKEN : ((1ULL << n_in_word) - 1ULL))
+                        << (granule & 63ULL);
+
+        if (taken) { *word |=  mask; }
+        else       { *word &= ~mask; }
+
+        granule += n_in_word;
+        n       -= n_in_word;
+    }
+}
+
+/* The first taken granule in [granule, limit), or limit if there isn't one. */
+internal u64 oblock_next_taken(oblock_header_t *oblock, u64 granule, u64 limit) {
+    u64 word;
+
+    while (granule < limit) {
+        word = oblock->meta->taken[granule >> 6ULL] & ~((1ULL << (granule & 63ULL)) - 1ULL);
+
+        if (word != 0) {
+            return MIN(limit, (granule & ~63ULL) + __builtin_ctzll(word));
+        }
+
+        granule = (granule | 63ULL) + 1;
+    }
+
+    return limit;
+}
+
+/* The first free granule at or after granule, or n_granules if there isn't one. */
+internal u64 oblock_next_free(oblock_header_t *oblock, u64 granule) {
+    u64 word;
+
+    while (granule < oblock->n_granules) {
+        word = oblock->meta->taken[granule >> 6ULL] | ((1ULL << (granule & 63ULL)) - 1ULL);
+
+        if (word != ALL_SLOTS_TAKEN) {
+            return MIN(oblock->n_granules, (granule & ~63ULL) + __builtin_ctzll(~word));
+        }
+
+        granule = (granule | 63ULL) + 1;
+    }
+
+    return oblock->n_granules;
+}
+
+internal void * oblock_get_mem_if_free(oblock_header_t *oblock, u64 n_bytes, u64 alignment) {
+    u64   n,
+          granule,
+          taken;
+    void *addr;
+
+    n = ALIGN(n_bytes, OBLOCK_GRANULE_SIZE) / OBLOCK_GRANULE_SIZE;
+
+    if (oblock->n_free_granules < n)    { return NULL; }
+
+    granule = 0;
+
+    for (;;) {
+        granule = oblock_next_free(oblock, granule);
+
+        if (alignment > OBLOCK_GRANULE_SIZE) {
+            /*
+             * The data area is page aligned, so an aligned address
+             * is always the start of some granule.
+             */
+            addr    = ALIGN(oblock->data + (granule * OBLOCK_GRANULE_SIZE), alignment);
+            granule = (addr - oblock->data) / OBLOCK_GRANULE_SIZE;
+        }
+
+        if (granule + n > oblock->n_granules)    { return NULL; }
+
+        taken = oblock_next_taken(oblock, granule, granule + n);
+
+        if (taken == granule + n)                { break; }
+
+        granule = taken + 1;
+    }
+
+    oblock_set_taken(oblock, granule, n, 1);
+    oblock->meta->n_granules[granule]  = n;
+    oblock->n_free_granules           -= n;
+
+    return oblock->data + (granule * OBLOCK_GRANULE_SIZE);
+}
+
+internal void * heap_alloc_from_oblocks(heap_t *heap, u64 n_bytes, u64 alignment) {
+    oblock_header_t *oblock;
+    void            *mem;
+
+    ASSERT(n_bytes <= OBLOCK_MAX_ALLOC_SIZE, "requesting too many bytes from oblock");
+
+    mem    = NULL;
+    oblock = heap->oblocks_tail;
+
+    while (oblock != NULL) {
+        mem = oblock_get_mem_if_free(oblock, n_bytes, alignment);
+
+        if (mem != NULL)    { break; }
+
+        oblock = oblock->prev;
+    }
+
+    if (mem == NULL) {
+        oblock = heap_new_oblock(heap);
+
+        if (unlikely(oblock == NULL))    { return NULL; }
+
+        heap_add_oblock(heap, oblock);
+        mem = oblock_get_mem_if_free(oblock, n_bytes, alignment);
+    }
+
+    ASSERT(mem != NULL, "did not get memory from oblock");
+    ASSERT(IS_ALIGNED(mem, MAX(alignment, 8)), "oblock memory is not aligned");
+
+    return mem;
+}
+
+internal u64 oblock_alloc_size(oblock_header_t *oblock, void *addr) {
+    u64 granule;
+
+    granule = (addr - oblock->data) / OBLOCK_GRANULE_SIZE;
+
+    return oblock->meta->n_granules[granule] * OBLOCK_GRANULE_SIZE;
+}
+
+internal void heap_free_from_oblock(heap_t *heap, oblock_header_t *oblock, void *addr) {
+    u64 granule,
+        n;
+
+    ASSERT(addr >= oblock->data && addr < oblock->end, "address isn't in oblock data");
+    ASSERT(IS_ALIGNED(addr - oblock->data, OBLOCK_GRANULE_SIZE), "address isn't the start of an oblock allocation");
+
+    granule = (addr - oblock->data) / OBLOCK_GRANULE_SIZE;
+    n       = oblock->meta->n_granules[granule];
+
+    ASSERT(n != 0, "double free error");
+
+    oblock_set_taken(oblock, granule, n, 0);
+    oblock->meta->n_granules[granule]  = 0;
+    oblock->n_free_granules           += n;
+
+    if (oblock->n_free_granules == oblock->n_granules) {
+        /* If this oblock isn't the only oblock in the heap... */
+        if (oblock != heap->oblocks_head || oblock != heap->oblocks_tail) {
+            heap_remove_oblock(heap, oblock);
+            release_oblock(heap, oblock);
+        }
+    }
+}
+
+internal void heap_free_big_chunk(heap_t *heap, block_header_t *block, chunk_header_t *big_chunk) {
     cblock_header_t *cblock;
 
     big_chunk->flags |= CHUNK_IS_FREE;
 
-    cblock = &((block_header_t*)ADDR_PARENT_BLOCK(big_chunk))->c;
+    cblock = &(block->c);
+
+    if (cblock->prev == NULL) {
+        heap->big_chunk_cblocks_live = cblock->next;
+    } else {
+        cblock->prev->next = cblock->next;
+    }
+    if (cblock->next != NULL) {
+        cblock->next->prev = cblock->prev;
+    }
 
     cblock->prev                 = heap->big_chunk_cblocks_tail;
     heap->big_chunk_cblocks_tail = cblock;
@@ -448,7 +1037,7 @@ internal chunk_header_t * heap_get_big_chunk(heap_t *heap, u64 n_bytes) {
     chunk       = NULL;
 
     while (cblock != NULL) {
-        cblock_n_pages = (cblock->end - (void*)ADDR_PARENT_BLOCK(cblock)) >> system_info.log_2_page_size;
+        cblock_n_pages = (cblock->end - (void*)cblock) >> system_info.log_2_page_size;
         cblock_avail   = LARGEST_CHUNK_IN_EMPTY_N_PAGE_BLOCK(cblock_n_pages);
 
         if (cblock_avail >= n_bytes) {
@@ -473,12 +1062,23 @@ internal chunk_header_t * heap_get_big_chunk(heap_t *heap, u64 n_bytes) {
 
     if (cblock == NULL) {
         cblock = heap_new_cblock(heap, n_bytes);
+
+        if (unlikely(cblock == NULL))    { return NULL; }
+
         chunk  = CBLOCK_FIRST_CHUNK(cblock);
     }
 
-    block      = ADDR_PARENT_BLOCK(cblock);
+    block      = (block_header_t*)cblock;
     block->tid = get_this_tid();
 
+    /* Keep track of it so that heap_release_all_blocks() can find it. */
+    cblock->prev = NULL;
+    cblock->next = heap->big_chunk_cblocks_live;
+    if (cblock->next != NULL) {
+        cblock->next->prev = cblock;
+    }
+    heap->big_chunk_cblocks_live = cblock;
+
     if (doing_profiling) {
         profile_add_block(cblock, n_bytes);
     }
@@ -495,7 +1095,7 @@ internal void * heap_big_alloc(heap_t *heap, u64 n_bytes) {
 
     chunk = heap_get_big_chunk(heap, n_bytes);
 
-    ASSERT(chunk != NULL, "did not get big chunk");
+    if (unlikely(chunk == NULL))    { return NULL; }
 
     mem = CHUNK_USER_MEM(chunk);
 
@@ -527,7 +1127,7 @@ internal void * heap_alloc(heap_t *heap, u64 n_bytes) {
      * strategy that gives each allocation that won't fit in an sblock
      * slot it's own block.
      * This allows us to map a read/write address back to it's object
-     * with a simple bit masking.
+     * with a single page map lookup.
      *
      * See src/profile.c
      */
@@ -536,7 +1136,12 @@ internal void * heap_alloc(heap_t *heap, u64 n_bytes) {
     }
 
 #ifdef HMALLOC_USE_SBLOCKS
-    if (n_bytes <= SBLOCK_MAX_ALLOC_SIZE) {
+    /*
+     * A small heap keeps everything in its slices until it is
+     * promoted (see small_heap.h), so that it doesn't map a whole
+     * sblock for a handful of objects.
+     */
+    if (n_bytes <= SBLOCK_MAX_ALLOC_SIZE && heap->small_slices_left == 0) {
         return heap_alloc_from_sblocks(heap, n_bytes);
     }
     /*
@@ -547,6 +1152,14 @@ internal void * heap_alloc(heap_t *heap, u64 n_bytes) {
 
     ASSERT(!doing_profiling, "shouldn't get here if we're doing object profiling");
 
+    if (heap->use_oblocks) {
+        if (n_bytes <= OBLOCK_MAX_ALLOC_SIZE) {
+            return heap_alloc_from_oblocks(heap, n_bytes, 8);
+        }
+        /* Too big for an oblock's data area. */
+        return heap_big_alloc(heap, n_bytes);
+    }
+
     cblock = heap->cblocks_tail;
 
     while (cblock != NULL) {
@@ -564,6 +1177,9 @@ internal void * heap_alloc(heap_t *heap, u64 n_bytes) {
          * So, we'll have to add a new cblock.
          */
         cblock = heap_new_cblock(heap, n_bytes);
+
+        if (unlikely(cblock == NULL))    { return NULL; }
+
         heap_add_cblock(heap, cblock);
         chunk = heap_get_chunk_from_cblock_if_free(heap, cblock, n_bytes);
     }
@@ -629,25 +1245,33 @@ internal void coalesce_free_chunk(cblock_header_t *cblock, chunk_header_t *chunk
     }
 }
 
-internal void heap_free_from_cblock(heap_t *heap, cblock_header_t *cblock, chunk_header_t *chunk) {
+internal int cblock_is_empty(cblock_header_t *cblock) {
     chunk_header_t *cblock_first_chunk;
 
+    /* If the cblock only has one free chunk... */
+    if (cblock->free_list_head == NULL
+    ||  cblock->free_list_head != cblock->free_list_tail) {
+        return 0;
+    }
+
+    /* and if that chunk spans the whole cblock. */
+    cblock_first_chunk = CBLOCK_FIRST_CHUNK(cblock);
+
+    return (((void*)cblock_first_chunk) + sizeof(chunk_header_t) + CHUNK_SIZE(cblock_first_chunk)) == cblock->end;
+}
+
+internal void heap_free_from_cblock(heap_t *heap, cblock_header_t *cblock, chunk_header_t *chunk) {
     ASSERT(!(chunk->flags & CHUNK_IS_FREE), "double free error");
 
     cblock_add_chunk_to_free_list(cblock, chunk);
 
     coalesce_free_chunk(cblock, chunk);
 
-    /* If the cblock only has one free chunk... */
-    if (cblock->free_list_head == cblock->free_list_tail) {
-        cblock_first_chunk = CBLOCK_FIRST_CHUNK(cblock);
-        /* and if that chunk spans the whole cblock -- release it. */
-        if ((((void*)cblock_first_chunk) + sizeof(chunk_header_t) +  CHUNK_SIZE(cblock_first_chunk)) == cblock->end) {
-            /* If this cblock isn't the only cblock in the heap... */
-            if (cblock != heap->cblocks_head || cblock != heap->cblocks_tail) {
-                heap_remove_cblock(heap, cblock);
-                release_cblock(cblock);
-            }
+    if (cblock_is_empty(cblock)) {
+        /* If this cblock isn't the only cblock in the heap... */
+        if (cblock != heap->cblocks_head || cblock != heap->cblocks_tail) {
+            heap_remove_cblock(heap, cblock);
+            release_cblock(heap, cblock);
         }
     }
 }
@@ -701,7 +1325,7 @@ internal void heap_free_from_sblock(heap_t *heap, sblock_header_t *sblock, void
         /* If this sblock isn't the only sblock in the heap... */
         if (sblock != heap->sblocks_head || sblock != heap->sblocks_tail) {
             heap_remove_sblock(heap, sblock);
-            release_sblock(sblock);
+            release_sblock(heap, sblock);
         }
     }
 }
@@ -709,31 +1333,211 @@ internal void heap_free_from_sblock(heap_t *heap, sblock_header_t *sblock, void
 #endif
 
 
-internal void heap_free(heap_t *heap, void *addr) {
-    block_header_t  *block;
+internal void heap_free(heap_t *heap, block_header_t *block, void *addr) {
     cblock_header_t *cblock;
     chunk_header_t  *chunk;
 
-    block = ADDR_PARENT_BLOCK(addr);
-
 #ifdef HMALLOC_USE_SBLOCKS
     if (block->block_kind == BLOCK_KIND_SBLOCK) {
         heap_free_from_sblock(heap, &(block->s), addr);
     } else
 #endif
-    {
+    if (block->block_kind == BLOCK_KIND_OBLOCK) {
+        heap_free_from_oblock(heap, &(block->o), addr);
+    } else {
         chunk = CHUNK_FROM_USER_MEM(addr);
         ASSERT(block->block_kind == BLOCK_KIND_CBLOCK, "block isn't cblock");
         cblock = &(block->c);
 
         if (chunk->flags & CHUNK_IS_BIG) {
-            heap_free_big_chunk(heap, chunk);
+            heap_free_big_chunk(heap, block, chunk);
         } else {
             heap_free_from_cblock(heap, cblock, chunk);
         }
     }
 }
 
+internal void heap_push_remote_oblock_node(heap_t *heap, remote_free_node_t *node) {
+    remote_free_node_t *head;
+
+    head = __atomic_load_n(&heap->remote_oblock_frees, __ATOMIC_RELAXED);
+
+    do {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n(&heap->remote_oblock_frees, &head, node,
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Called by any thread that isn't the heap's owner.
+ * Doesn't need the heap to be locked.
+ * oblock memory is queued on a node of its own so that its page
+ * isn't dirtied. If we can't get a node, dirtying the page is still
+ * better than losing the free.
+ */
+internal void heap_push_remote_free(heap_t *heap, block_header_t *block, void *addr) {
+    remote_free_node_t *node;
+
+    if (unlikely(block->block_kind == BLOCK_KIND_OBLOCK)) {
+        node = imalloc(sizeof(remote_free_node_t));
+
+        if (likely(node != NULL)) {
+            node->addr = addr;
+            heap_push_remote_oblock_node(heap, node);
+            return;
+        }
+
+        LOG("out of memory for an oblock remote free node -- linking through %p\n", addr);
+    }
+
+    heap_push_remote_frees(heap, addr, addr);
+}
+
+/* Push a list that is already linked from first to last in one go. */
+internal void heap_push_remote_frees(heap_t *heap, void *first, void *last) {
+    void *head;
+
+    head = __atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED);
+
+    do {
+        *(void**)last = head;
+    } while (!__atomic_compare_exchange_n(&heap->remote_frees, &head, first,
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Called with the heap locked (or by its owner).
+ * Queue every block that the heap is only keeping around for reuse:
+ * empty blocks, cached big chunk cblocks, the spare and the blocks
+ * that the heap's attributes keep (which will just be kept again
+ * unless max_retained has been cleared).
+ * Blocks that still have live allocations in them are kept.
+ */
+internal void heap_release_empty_blocks(heap_t *heap) {
+    cblock_header_t    *cblock,
+                       *cblock_prev;
+#ifdef HMALLOC_USE_SBLOCKS
+    sblock_header_t    *sblock,
+                       *sblock_prev;
+#endif
+    oblock_header_t    *oblock,
+                       *oblock_prev;
+    deferred_release_t *release,
+                       *next;
+
+    for (cblock = heap->cblocks_tail; cblock != NULL; cblock = cblock_prev) {
+        cblock_prev = cblock->prev;
+        if (cblock_is_empty(cblock)) {
+            heap_remove_cblock(heap, cblock);
+            release_cblock(heap, cblock);
+        }
+    }
+
+#ifdef HMALLOC_USE_SBLOCKS
+    for (sblock = heap->sblocks_tail; sblock != NULL; sblock = sblock_prev) {
+        sblock_prev = sblock->prev;
+        if (sblock->n_empty_regions == 63) {
+            heap_remove_sblock(heap, sblock);
+            release_sblock(heap, sblock);
+        }
+    }
+#endif
+
+    for (oblock = heap->oblocks_tail; oblock != NULL; oblock = oblock_prev) {
+        oblock_prev = oblock->prev;
+        if (oblock->n_free_granules == oblock->n_granules) {
+            heap_remove_oblock(heap, oblock);
+            release_oblock(heap, oblock);
+        }
+    }
+
+    /* Release overwrites the cblock header, so walk ahead of it. */
+    for (cblock = heap->big_chunk_cblocks_tail; cblock != NULL; cblock = cblock_prev) {
+        cblock_prev = cblock->prev;
+        release_cblock(heap, cblock);
+    }
+    heap->big_chunk_cblocks_tail = NULL;
+
+    /* The spare doesn't have a header or page map entries yet. */
+    release = __atomic_exchange_n(&heap->spare_block, NULL, __ATOMIC_ACQUIRE);
+
+    if (release != NULL) {
+        release->n_pages        = DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size;
+        release->provider       = heap->provider;
+        release->next           = heap->deferred_releases;
+        heap->deferred_releases = release;
+    }
+
+    release = __atomic_exchange_n(&heap->retained, NULL, __ATOMIC_ACQUIRE);
+
+    while (release != NULL) {
+        next                    = release->next;
+        release->next           = heap->deferred_releases;
+        heap->deferred_releases = release;
+        release                 = next;
+
+        __atomic_sub_fetch(&heap->n_retained, 1, __ATOMIC_RELAXED);
+    }
+
+    heap->wants_spare = 0;
+}
+
+/*
+ * Called with the heap locked.
+ * Queue every block that the heap has, whether or not there's
+ * anything live in it, and leave the heap empty.
+ * The spare is kept since nothing has been allocated from it.
+ */
+internal void heap_release_all_blocks(heap_t *heap) {
+    cblock_header_t *cblock,
+                    *cblock_prev,
+                    *cblock_next;
+#ifdef HMALLOC_USE_SBLOCKS
+    sblock_header_t *sblock,
+                    *sblock_prev;
+#endif
+    oblock_header_t *oblock,
+                    *oblock_prev;
+
+    /* Release overwrites the block headers, so walk ahead of it. */
+    for (cblock = heap->cblocks_tail; cblock != NULL; cblock = cblock_prev) {
+        cblock_prev = cblock->prev;
+        release_cblock(heap, cblock);
+    }
+    heap->cblocks_head = heap->cblocks_tail = NULL;
+
+#ifdef HMALLOC_USE_SBLOCKS
+    for (sblock = heap->sblocks_tail; sblock != NULL; sblock = sblock_prev) {
+        sblock_prev = sblock->prev;
+        release_sblock(heap, sblock);
+    }
+    heap->sblocks_head = heap->sblocks_tail = NULL;
+#endif
+
+    for (oblock = heap->oblocks_tail; oblock != NULL; oblock = oblock_prev) {
+        oblock_prev = oblock->prev;
+        release_oblock(heap, oblock);
+    }
+    heap->oblocks_head = heap->oblocks_tail = NULL;
+
+    for (cblock = heap->big_chunk_cblocks_live; cblock != NULL; cblock = cblock_next) {
+        cblock_next = cblock->next;
+
+        if (doing_profiling) {
+            profile_delete_block(cblock);
+        }
+
+        release_cblock(heap, cblock);
+    }
+    heap->big_chunk_cblocks_live = NULL;
+
+    for (cblock = heap->big_chunk_cblocks_tail; cblock != NULL; cblock = cblock_prev) {
+        cblock_prev = cblock->prev;
+        release_cblock(heap, cblock);
+    }
+    heap->big_chunk_cblocks_tail = NULL;
+}
+
 internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignment) {
     cblock_header_t *cblock;
     sblock_header_t *sblock;
@@ -753,6 +1557,8 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
 
     if (n_bytes < 8)               { n_bytes = 8; }
 
+    n_bytes = ALIGN(n_bytes, 8);
+
     /*
      * All sblock slots *EXCEPT FOR THE FIRST ONE* are aligned on
      * SBLOCK_SLOT_SIZE boundaries.
@@ -764,13 +1570,19 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
      * So, we'll just give up after the second try and continue to the
      * primary code path.
      */
-    if (n_bytes <= SBLOCK_MAX_ALLOC_SIZE && alignment <= SBLOCK_SLOT_SIZE){
+    if (n_bytes <= SBLOCK_MAX_ALLOC_SIZE && alignment <= SBLOCK_SLOT_SIZE
+    &&  heap->small_slices_left == 0) {
         mem = heap_alloc_from_sblocks(heap, n_bytes);
+
+        if (unlikely(mem == NULL))    { return NULL; }
+
         if (!IS_ALIGNED(mem, SBLOCK_SLOT_SIZE)) {
             sblock_not_aligned = mem;
             sblock = &((block_header_t*)ADDR_PARENT_BLOCK(sblock_not_aligned))->s;
             mem = heap_alloc_from_sblocks(heap, n_bytes);
             heap_free_from_sblock(heap, sblock, sblock_not_aligned);
+
+            if (unlikely(mem == NULL))    { return NULL; }
         }
         if (IS_ALIGNED(mem, SBLOCK_SLOT_SIZE)) {
             ASSERT(IS_ALIGNED(mem, alignment), "failed to align from slot allocation");
@@ -802,6 +1614,14 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
         return heap_big_alloc(heap, n_bytes);
     }
 
+    /*
+     * oblocks can place an allocation at any granule, so they can
+     * handle alignment directly.
+     */
+    if (heap->use_oblocks && n_bytes + alignment <= OBLOCK_MAX_ALLOC_SIZE) {
+        return heap_alloc_from_oblocks(heap, n_bytes, alignment);
+    }
+
     /*
      * If size is big:
      * Use the regular big chunk procedure to get memory, but
@@ -810,6 +1630,9 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
      */
     if (n_bytes + alignment > MAX_SMALL_CHUNK) {
         chunk = heap_get_big_chunk(heap, n_bytes + alignment);
+
+        if (unlikely(chunk == NULL))    { return NULL; }
+
         mem   = ALIGN(CHUNK_USER_MEM(chunk), alignment);
         memcpy(mem - sizeof(chunk_header_t), chunk, sizeof(chunk_header_t));
         return mem;
@@ -819,9 +1642,13 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
 
     new_cblock_size_request =   n_bytes                /* The bytes we need to give the user. */
                              + alignment               /* Make sure there's space to align. */
-                             + sizeof(chunk_header_t); /* We're going to put another chunk in there. */
+                             + sizeof(chunk_header_t)  /* We're going to put another chunk in there. */
+                             + 8;                      /* And it can't be empty. */
 
     cblock = heap_new_cblock(heap, new_cblock_size_request);
+
+    if (unlikely(cblock == NULL))    { return NULL; }
+
     block  = (block_header_t*)cblock;
     heap_add_cblock(heap, cblock);
 
@@ -834,7 +1661,11 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
 
         ASSERT(first_chunk_check == chunk, "first chunk mismatch");
     } else {
-        aligned_addr = ALIGN(CHUNK_USER_MEM(first_chunk_check), alignment);
+        /*
+         * The chunk in front of ours needs room for its header and
+         * at least 8 bytes of its own.
+         */
+        aligned_addr = ALIGN(CHUNK_USER_MEM(first_chunk_check) + sizeof(chunk_header_t) + 8, alignment);
 
         first_chunk_size =   (aligned_addr - sizeof(chunk_header_t))
                            - (((void*)block) + sizeof(block_header_t) + sizeof(chunk_header_t));
@@ -844,7 +1675,7 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
         ASSERT(first_chunk != NULL, "did not get first chunk");
         ASSERT(first_chunk_check == first_chunk, "first chunk mismatch");
 
-        heap_free(heap, CHUNK_USER_MEM(first_chunk));
+        heap_free(heap, block, CHUNK_USER_MEM(first_chunk));
     }
 
 
@@ -858,7 +1689,6 @@ internal void * heap_aligned_alloc(heap_t *heap, size_t n_bytes, size_t alignmen
     return mem;
 }
 
-internal i32 heap_handle_equ(heap_handle_t a, heap_handle_t b) { return strcmp(a, b) == 0; }
 internal u64 heap_handle_hash(heap_handle_t h) {
     unsigned long hash = 5381;
     int           c;
@@ -869,35 +1699,377 @@ internal u64 heap_handle_hash(heap_handle_t h) {
     return hash;
 }
 
+internal user_heap_table_t * user_heap_table_make(u64 capacity) {
+    u64 n_pages;
+
+    n_pages = ALIGN(sizeof(user_heap_table_t) + capacity * sizeof(user_heap_entry_t),
+                    system_info.page_size)
+                >> system_info.log_2_page_size;
+
+    return get_pages_from_os(n_pages, system_info.page_size);
+}
+
+/* Returns the heap for handle or NULL. Doesn't lock. */
+internal heap_t * user_heap_table_find(user_heap_table_t *table, heap_handle_t handle, u64 hash) {
+    user_heap_entry_t *entry;
+    heap_t            *heap;
+    u64                mask,
+                       i;
+
+    mask = table->capacity - 1;
+
+    for (i = hash & mask;; i = (i + 1) & mask) {
+        entry = table->entries + i;
+        heap  = __atomic_load_n(&entry->heap, __ATOMIC_ACQUIRE);
+
+        if (heap == NULL)                   { return NULL; }
+        if (heap == USER_HEAP_TOMBSTONE)    { continue;    }
+
+        if (entry->hash == hash
+        &&  (heap->__meta.handle == handle
+        ||   strcmp(heap->__meta.handle, handle) == 0)) {
+            return heap;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Called with user_heaps_lock held. The table must have room.
+ * Takes the first tombstone or empty entry in heap's probe sequence.
+ */
+internal void user_heap_table_add(user_heap_table_t *table, heap_t *heap, u64 hash) {
+    user_heap_entry_t *entry;
+    u64                mask,
+                       i;
+
+    mask = table->capacity - 1;
+
+    for (i = hash & mask;; i = (i + 1) & mask) {
+        entry = table->entries + i;
+
+        if (entry->heap == NULL
+        ||  entry->heap == USER_HEAP_TOMBSTONE) {
+            break;
+        }
+    }
+
+    if (entry->heap == NULL) {
+        table->n_entries += 1;
+    }
+    table->n_live += 1;
+
+    entry->hash = hash;
+    __atomic_store_n(&entry->heap, heap, __ATOMIC_RELEASE);
+}
+
+/* Called with user_heaps_lock held. */
+internal void user_heap_table_remove(user_heap_table_t *table, heap_t *heap, u64 hash) {
+    user_heap_entry_t *entry;
+    u64                mask,
+                       i;
+
+    mask = table->capacity - 1;
+
+    for (i = hash & mask;; i = (i + 1) & mask) {
+        entry = table->entries + i;
+
+        if (entry->heap == heap)    { break; }
+
+        ASSERT(entry->heap != NULL, "user heap is missing from the directory");
+    }
+
+    __atomic_store_n(&entry->heap, USER_HEAP_TOMBSTONE, __ATOMIC_RELEASE);
+
+    table->n_live -= 1;
+}
+
+/*
+ * Called with user_heaps_lock held.
+ * Put the live entries of from into to, which is either empty or
+ * the same table (in which case it gets emptied first).
+ */
+internal int user_heap_table_rebuild(user_heap_table_t *from, user_heap_table_t *to) {
+    user_heap_entry_t *live;
+    heap_t            *heap;
+    u64                n_live,
+                       i;
+
+    live = imalloc(from->n_live * sizeof(user_heap_entry_t) + 1);
+
+    if (unlikely(live == NULL))    { return 0; }
+
+    n_live = 0;
+
+    for (i = 0; i < from->capacity; i += 1) {
+        heap = from->entries[i].heap;
+        if (heap != NULL && heap != USER_HEAP_TOMBSTONE) {
+            live[n_live] = from->entries[i];
+            n_live      += 1;
+        }
+    }
+
+    if (to == from) {
+        for (i = 0; i < to->capacity; i += 1) {
+            __atomic_store_n(&to->entries[i].heap, NULL, __ATOMIC_RELAXED);
+        }
+        to->n_entries = 0;
+        to->n_live    = 0;
+    }
+
+    for (i = 0; i < n_live; i += 1) {
+        user_heap_table_add(to, live[i].heap, live[i].hash);
+    }
+
+    ifree(live);
+
+    return 1;
+}
+
+/*
+ * Called with user_heaps_lock held.
+ * Returns the table to insert into, which is a new one if the
+ * current one is too full, or NULL if we couldn't get memory.
+ */
+internal user_heap_table_t * user_heap_table_reserve(user_heap_table_t *table) {
+    user_heap_table_t *new_table;
+
+    if (likely(2 * (table->n_entries + 1) <= table->capacity))    { return table; }
+
+    if (4 * (table->n_live + 1) <= table->capacity) {
+        /* It's mostly tombstones. */
+        if (unlikely(!user_heap_table_rebuild(table, table)))    { return NULL; }
+
+        LOG("cleared tombstones out of the user heap directory\n");
+
+        return table;
+    }
+
+    new_table = user_heap_table_make(2 * table->capacity);
+
+    if (unlikely(new_table == NULL))    { return NULL; }
+
+    new_table->capacity = 2 * table->capacity;
+
+    if (unlikely(!user_heap_table_rebuild(table, new_table))) {
+        release_pages_to_os(new_table,
+                            ALIGN(sizeof(user_heap_table_t) + new_table->capacity * sizeof(user_heap_entry_t),
+                                  system_info.page_size)
+                                >> system_info.log_2_page_size);
+        return NULL;
+    }
+
+    __atomic_store_n(&user_heaps, new_table, __ATOMIC_RELEASE);
+
+    LOG("grew the user heap directory to %llu entries\n", new_table->capacity);
+
+    return new_table;
+}
+
 internal void user_heaps_init(void) {
-    USER_HEAPS_LOCK(); {
-        user_heaps = hash_table_make_e(heap_handle_t, heap_t, heap_handle_hash, heap_handle_equ);
-    } USER_HEAPS_UNLOCK();
+    user_heap_table_t *table;
+
+    table = user_heap_table_make(USER_HEAPS_INITIAL_CAPACITY);
+
+    ASSERT(table != NULL, "could not get memory for the user heap directory");
+
+    table->capacity = USER_HEAPS_INITIAL_CAPACITY;
+
+    __atomic_store_n(&user_heaps, table, __ATOMIC_RELEASE);
+
     LOG("initialized user heaps table\n");
 }
 
-internal heap_t * get_or_make_user_heap(char *handle) {
-    heap_t *heap,
-            new_heap;
-    char   *cpy;
+/* Called with user_heaps_lock held. */
+internal user_heap_t * user_heap_new(char *handle) {
+    user_heap_t **dead_ptr,
+                 *uh;
+    u64           len;
+
+    len = strlen(handle);
+
+    for (dead_ptr = &dead_user_heaps; *dead_ptr != NULL; dead_ptr = &(*dead_ptr)->next_dead) {
+        if ((*dead_ptr)->handle_cap > len) {
+            uh        = *dead_ptr;
+            *dead_ptr = uh->next_dead;
+            goto found;
+        }
+    }
+
+    /* Zeroed so that the last byte of the buffer is always a terminator. */
+    uh = icalloc(1, sizeof(user_heap_t) + len + 1);
+
+    if (unlikely(uh == NULL))    { return NULL; }
+
+    uh->handle_cap = len + 1;
+
+found:;
+    memcpy(uh->handle_buff, handle, len + 1);
+    uh->next_dead   = NULL;
+    uh->shards      = NULL;
+    uh->n_shards    = 0;
+    uh->n_contended     = 0;
+    uh->contended_since = 0;
+
+    heap_make(&uh->heap);
+    uh->heap.__meta.handle = uh->handle_buff;
+    uh->heap.__meta.flags |= HEAP_USER;
+
+    if (uh->heap.provider == &os_page_provider && !uh->heap.use_oblocks) {
+        uh->heap.small_slices_left = hmalloc_small_heap_slices;
+    }
+
+    return uh;
+}
+
+/*
+ * attr is only used if the heap is made here. It's set before the
+ * heap is published, so nobody sees the heap without it.
+ */
+internal heap_t * get_or_make_user_heap_with_attr(char *handle, const hmalloc_heap_attr_t *attr) {
+    user_heap_table_t *table;
+    user_heap_t       *uh;
+    heap_t            *heap;
+    u64                hash;
+    int                made;
+
+    hash = heap_handle_hash(handle);
+    heap = user_heap_table_find(__atomic_load_n(&user_heaps, __ATOMIC_ACQUIRE), handle, hash);
+
+    if (likely(heap != NULL))    { return heap; }
+
+    made = 0;
 
     USER_HEAPS_LOCK(); {
-        heap = hash_table_get_val(user_heaps, handle);
-        if (!heap) {
-            cpy = istrdup(handle);
+        /* Someone may have beaten us to it. */
+        table = user_heaps;
+        heap  = user_heap_table_find(table, handle, hash);
+
+        if (heap == NULL) {
+            table = user_heap_table_reserve(table);
+            uh    = table ? user_heap_new(handle) : NULL;
 
-            heap_make(&new_heap);
-            new_heap.__meta.handle = cpy;
-            new_heap.__meta.flags |= HEAP_USER;
+            if (uh != NULL) {
+                heap = &uh->heap;
 
-            hash_table_insert(user_heaps, cpy, new_heap);
-            heap = hash_table_get_val(user_heaps, handle);
+                if (attr != NULL) {
+                    heap->attr = *attr;
 
-            ASSERT(heap, "error creating new user heap");
+                    /* Slices are shared, so they can't have attributes. */
+                    if (HEAP_HAS_PAGE_ATTR(heap) || attr->max_retained != 0) {
+                        heap->small_slices_left = 0;
+                    }
+                }
 
-            LOG("hid %d is a user heap created by tid %d (handle = '%s')\n", heap->__meta.hid, get_this_tid(), heap->__meta.handle);
+                user_heap_table_add(table, heap, hash);
+                made = 1;
+
+                LOG("hid %d is a user heap created by os tid %d (handle = '%s')\n", heap->__meta.hid, os_get_tid(), heap->__meta.handle);
+            } else {
+                ASSERT(0, "error creating new user heap");
+            }
         }
     } USER_HEAPS_UNLOCK();
 
+    /*
+     * Give a heap with page attributes its first block now, while
+     * nothing is locked. Applying the attributes can mean binding,
+     * locking or faulting in a whole block, which shouldn't happen
+     * in the heap's critical section. After this, each block it
+     * takes is replaced the same way once its lock is dropped.
+     */
+    if (made && HEAP_HAS_PAGE_ATTR(heap)) {
+        heap_refill_spare(heap);
+    }
+
     return heap;
 }
+
+internal heap_t * get_or_make_user_heap(char *handle) {
+    return get_or_make_user_heap_with_attr(handle, NULL);
+}
+
+/* Take a user heap out of the directory so that lookups don't find it. */
+internal void remove_user_heap(heap_t *heap) {
+    ASSERT(heap->__meta.flags & HEAP_USER, "removing a heap that isn't a user heap");
+
+    USER_HEAPS_LOCK(); {
+        user_heap_table_remove(user_heaps, heap, heap_handle_hash(heap->__meta.handle));
+    } USER_HEAPS_UNLOCK();
+
+    LOG("removed hid %d (user heap '%s') from the directory\n", heap->__meta.hid, heap->__meta.handle);
+}
+
+/*
+ * Split a user heap into per-CPU shards.
+ * If two threads get here at once, the first one to publish its
+ * shards wins.
+ */
+internal void make_user_heap_shards(user_heap_t *uh) {
+    heap_t *shards,
+           *expected;
+    u64     n_pages;
+    u32     n_shards,
+            i;
+
+    n_shards = system_info.n_cpus;
+    n_pages  = ALIGN(n_shards * sizeof(heap_t), system_info.page_size)
+                 >> system_info.log_2_page_size;
+    shards   = get_pages_from_os(n_pages, system_info.page_size);
+
+    if (unlikely(shards == NULL))    { return; }
+
+    for (i = 0; i < n_shards; i += 1) {
+        heap_make(shards + i);
+        shards[i].__meta.handle = uh->heap.__meta.handle;
+        shards[i].__meta.flags |= HEAP_USER;
+        shards[i].provider      = uh->heap.provider;
+        shards[i].use_oblocks   = uh->heap.use_oblocks;
+        shards[i].attr          = uh->heap.attr;
+        shards[i].parent        = &uh->heap;
+
+        /* The same rules as for a new user heap (see user_heap_new()). */
+        if (shards[i].provider == &os_page_provider
+        &&  !shards[i].use_oblocks
+        &&  !HEAP_HAS_PAGE_ATTR(&shards[i])
+        &&  shards[i].attr.max_retained == 0) {
+            shards[i].small_slices_left = hmalloc_small_heap_slices;
+        }
+    }
+
+    uh->n_shards = n_shards;
+    expected     = NULL;
+
+    if (!__atomic_compare_exchange_n(&uh->shards, &expected, shards,
+                                     0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        release_pages_to_os(shards, n_pages);
+        return;
+    }
+
+    LOG("split user heap '%s' into %u shards\n", uh->heap.__meta.handle, n_shards);
+}
+
+/* Called once nothing can be using the shards any more. */
+internal void free_user_heap_shards(user_heap_t *uh) {
+    if (uh->shards == NULL)    { return; }
+
+    release_pages_to_os(uh->shards,
+                        ALIGN(uh->n_shards * sizeof(heap_t), system_info.page_size)
+                            >> system_info.log_2_page_size);
+
+    uh->shards   = NULL;
+    uh->n_shards = 0;
+}
+
+/* Keep a removed (and emptied) user heap for reuse. */
+internal void recycle_user_heap(heap_t *heap) {
+    user_heap_t *uh;
+
+    uh = (user_heap_t*)heap;
+
+    USER_HEAPS_LOCK(); {
+        uh->next_dead   = dead_user_heaps;
+        dead_user_heaps = uh;
+    } USER_HEAPS_UNLOCK();
+}
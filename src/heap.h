@@ -2,7 +2,9 @@
 #define __HEAP_H__
 
 #include "internal.h"
-#include "hash_table.h"
+#include "hmalloc.h"
+#include "page_map.h"
+#include "lock.h"
 
 #include <pthread.h>
 
@@ -29,10 +31,15 @@ typedef struct cblock_header {
                          *free_list_tail;
     struct cblock_header *prev;
     void                 *end;
+    /* Only used to link big chunk cblocks that are in use. */
+    struct cblock_header *next;
 } cblock_header_t;
 
 #define BLOCK_KIND_CBLOCK (0x1)
 #define BLOCK_KIND_SBLOCK (0x2)
+#define BLOCK_KIND_OBLOCK (0x3)
+#define BLOCK_KIND_BBLOCK (0x4)
+#define BLOCK_KIND_PBLOCK (0x5)
 
 typedef struct sblock_header {
     u64                   bitfield_available_regions;
@@ -54,6 +61,62 @@ typedef struct {
 #define SBLOCK_MAX_ALLOC_SIZE (SBLOCK_SLOT_SIZE - sizeof(sblock_region_header_t))
 #define SBLOCK_REGION_SIZE    (64ULL * SBLOCK_SLOT_SIZE)
 
+/*
+ * oblocks are cblocks that keep all of their chunk metadata out of
+ * band: a bitmap of taken granules and a table of allocation sizes
+ * live in the first pages of the block and user memory starts on
+ * the next page boundary.
+ * The allocator never writes to an oblock's data pages, so they
+ * aren't dirtied (or copied after fork()) behind the user's back,
+ * and searching for space doesn't touch user data.
+ */
+#define OBLOCK_GRANULE_SIZE (256ULL)
+#define OBLOCK_MAX_GRANULES (DEFAULT_BLOCK_SIZE / OBLOCK_GRANULE_SIZE)
+
+typedef struct {
+    u64 taken[OBLOCK_MAX_GRANULES / 64];
+    u16 n_granules[OBLOCK_MAX_GRANULES];
+} oblock_meta_t;
+
+typedef struct oblock_header {
+    oblock_meta_t        *meta;
+    void                 *data;
+    struct oblock_header *prev;
+    void                 *end;
+    u32                   n_granules;
+    u32                   n_free_granules;
+} oblock_header_t;
+
+/*
+ * bblocks belong to bump heaps (see bump_heap.h). Allocations are
+ * laid out one after another from the start of the block, each one
+ * after a u64 holding its size; top is where the next one goes.
+ */
+typedef struct bblock_header {
+    void                 *top;
+    struct bblock_header *prev;
+    void                 *end;
+} bblock_header_t;
+
+/*
+ * pblocks belong to object pools (see pool.h) and are cut into
+ * equal slots. A bitmap of taken slots and one of slots whose object
+ * has been constructed follow the block header.
+ * n_taken and next_word (the lowest bitmap word that may have a free
+ * slot) are only touched with the pool locked.
+ */
+typedef struct pblock_header {
+    struct pblock_header *prev,
+                         *next;
+    void                 *end;
+    u32                   n_taken;
+    u32                   next_word;
+} pblock_header_t;
+
+#define OBLOCK_DATA_OFFSET \
+    (ALIGN(sizeof(block_header_t) + sizeof(oblock_meta_t), system_info.page_size))
+#define OBLOCK_MAX_ALLOC_SIZE (DEFAULT_BLOCK_SIZE - OBLOCK_DATA_OFFSET)
+
 #define SBLOCK_GET_REGION(sblock, N)                           \
     ((sblock_region_header_t*)(                                \
       ((void*)(sblock)) + ((N) * (64ULL * SBLOCK_SLOT_SIZE))))
@@ -68,26 +131,52 @@ typedef struct {
 typedef struct {
     union {
         char *handle;
-        u16   tid;
+        u32   tid;
     };
     u32       hid;
     u16       flags;
 } heap__meta_t;
 
 
-typedef struct {
+typedef struct block_header {
     union {
         cblock_header_t c;
         sblock_header_t s;
+        oblock_header_t o;
+        bblock_header_t b;
+        pblock_header_t p;
     };
-    heap__meta_t        heap__meta;
-    u16                 tid;
-    u8                  block_kind;
+    heap__meta_t             heap__meta;
+    /*
+     * The heap that the block belongs to, so that frees don't need
+     * to look it up. Thread heaps still go by heap__meta.tid since
+     * their blocks can change hands.
+     */
+    struct heap             *heap;
+    hmalloc_page_provider_t *provider;
+    u32                      tid;
+    u8                       block_kind;
+    /*
+     * Ownership migration for thread heaps (see thread.c).
+     * The counters belong to the owner. last_remote_tid is a hint
+     * from whoever freed into the block from another thread last
+     * (tid + 1, zero for none).
+     */
+    u32                      n_frees;
+    u32                      n_remote_frees;
+    u32                      last_remote_tid;
+    struct block_header     *next_incoming;
 } block_header_t;
 
 
-#define ADDR_PARENT_BLOCK(addr) \
-    ((block_header_t*)(void*)(((u64)(void*)(addr)) & ~(DEFAULT_BLOCK_SIZE - 1)))
+/*
+ * Standard blocks only need to be aligned well enough for sblock
+ * regions to be aligned. Finding the block for an address is done
+ * through the page map, not by masking.
+ */
+#define BLOCK_ALIGNMENT (SBLOCK_REGION_SIZE)
+
+#define ADDR_PARENT_BLOCK(addr) ((block_header_t*)page_map_lookup((addr)))
 
 
 #define CHUNK_SIZE(addr) (((chunk_header_t*)((void*)(addr)))->size << 3ULL)
@@ -128,9 +217,6 @@ typedef struct {
 
 #define CHUNK_DISTANCE(a, b) (((void*)(a)) - (((void*)(b))))
 
-#define CHUNK_PARENT_BLOCK(addr) \
-    ADDR_PARENT_BLOCK(addr)
-
 
 #define CBLOCK_FIRST_CHUNK(addr) (((void*)(addr)) + sizeof(block_header_t))
 
@@ -145,33 +231,182 @@ typedef struct {
 
 #define HEAP_THREAD (0x1)
 #define HEAP_USER   (0x2)
+#define HEAP_SHARED (0x4)
+#define HEAP_BUMP   (0x8)
+#define HEAP_POOL   (0x10)
 
 internal u32 hid_counter;
 
-typedef struct {
-    cblock_header_t  *cblocks_head,
-                     *cblocks_tail,
-                     *big_chunk_cblocks_tail;
+/*
+ * Blocks that a heap is done with are queued on the heap while it
+ * is locked and handed back to their page provider after the lock
+ * is released.
+ * The queue entry is written over the start of the dead block.
+ */
+typedef struct deferred_release {
+    struct deferred_release *next;
+    u64                      n_pages;
+    hmalloc_page_provider_t *provider;
+} deferred_release_t;
+
+typedef struct remote_free_node {
+    struct remote_free_node *next;
+    void                    *addr;
+} remote_free_node_t;
+
+/*
+ * A thread heap's lock is never taken. Apart from the queues below,
+ * its fields are only read or written by the owning thread. Other
+ * threads that free into a thread heap push the address onto
+ * remote_frees instead; the owner takes the whole stack and frees
+ * everything on it the next time it allocates. The stack is linked through the freed memory itself,
+ * except for oblock memory, which the allocator must not write to:
+ * those frees go on remote_oblock_frees, one node from the internal
+ * allocator each.
+ * Blocks handed over from another thread heap arrive on
+ * incoming_blocks and are put on the lists the same way.
+ * User heaps are shared and always locked.
+ * Bump heaps are never locked (see bump_heap.h).
+ * Pools use the heap struct for its lock, provider and spare block
+ * (see pool.h).
+ */
+typedef struct heap {
+    cblock_header_t         *cblocks_head,
+                            *cblocks_tail,
+                            *big_chunk_cblocks_tail,
+                            *big_chunk_cblocks_live;
 #ifdef HMALLOC_USE_SBLOCKS
-    sblock_header_t  *sblocks_head,
-                     *sblocks_tail;
+    sblock_header_t         *sblocks_head,
+                            *sblocks_tail;
 #endif
-    heap__meta_t      __meta;
-    pthread_mutex_t   mtx;
+    oblock_header_t         *oblocks_head,
+                            *oblocks_tail;
+    bblock_header_t         *bblocks_tail;
+    hmalloc_page_provider_t *provider;
+    void                    *spare_block;
+    deferred_release_t      *deferred_releases;
+    void                    *remote_frees;
+    remote_free_node_t      *remote_oblock_frees;
+    struct block_header     *incoming_blocks;
+    u64                      n_os_allocs;
+    u32                      wants_spare;
+    u32                      use_oblocks;
+    heap__meta_t             __meta;
+    LOCK_PAD(lock_pad_before);
+    hmalloc_lock_t           lock;
+    LOCK_PAD(lock_pad_after);
+    /*
+     * Page attributes and the empty blocks that the attributes say
+     * to keep. Blocks are pushed onto retained without the lock and
+     * taken off with it.
+     */
+    hmalloc_heap_attr_t      attr;
+    deferred_release_t      *retained;
+    u32                      n_retained;
+    /* Shared slices left before the heap is promoted (see small_heap.h). */
+    u32                      small_slices_left;
+    /* The user heap that this heap is a shard of, if it is one. */
+    struct heap             *parent;
 } heap_t;
 
+#define HEAP_HAS_PAGE_ATTR(heap_ptr) \
+    ((heap_ptr)->attr.flags != 0 || (heap_ptr)->attr.numa_node >= 0)
+
 internal void heap_make(heap_t *heap);
 internal void * heap_alloc(heap_t *heap, u64 n_bytes);
+internal void heap_finish_unlocked(heap_t *heap, deferred_release_t *releases, u32 wants_spare);
+internal void heap_free(heap_t *heap, block_header_t *block, void *addr);
+internal void heap_push_remote_free(heap_t *heap, block_header_t *block, void *addr);
+internal void heap_push_remote_oblock_node(heap_t *heap, remote_free_node_t *node);
+internal void heap_push_remote_frees(heap_t *heap, void *first, void *last);
+internal void heap_release_empty_blocks(heap_t *heap);
+internal void heap_release_all_blocks(heap_t *heap);
 
 typedef char *heap_handle_t;
 
-#define malloc imalloc
-#define free   ifree
-use_hash_table(heap_handle_t, heap_t);
-#undef malloc
-#undef free
+/*
+ * The user heap directory.
+ *
+ * An open addressing table (linear probing) of heap pointers with
+ * the hash of each heap's handle cached next to it. Lookups don't
+ * lock, so they can see an entry that is stale or torn: a heap
+ * pointer paired with a hash from another entry, or a heap that has
+ * since been removed or rebuilt elsewhere in the table. The cached
+ * hash is only a filter. A lookup only returns a heap after
+ * comparing the handle against that heap's own interned handle.
+ * When a lookup misses, get_or_make_user_heap() takes the lock and
+ * looks again before it makes a heap.
+ *
+ * Inserts and removals are serialized by user_heaps_lock.
+ * A removed entry becomes a tombstone, which inserts reuse. When
+ * the table gets half full (tombstones included), it's either
+ * rebuilt in place, if the live entries would only fill a quarter
+ * of it, or a copy twice the size is built and then published.
+ * A reader that races with a rebuild can miss a heap that is there,
+ * but it then takes the lock and looks again, so that's fine.
+ * Readers that are still probing an old table are fine because old
+ * tables are never unmapped (together they're smaller than the
+ * current one).
+ *
+ * A user heap is allocated together with the buffer that holds its
+ * interned handle, so its address doesn't change when the table
+ * does. Destroyed heaps are kept on dead_user_heaps and reused for
+ * new heaps whose names fit their buffers, rather than freed, since
+ * a lookup may still be comparing against the old name.
+ *
+ * Shards.
+ * Once allocating from a user heap has found its lock taken
+ * USER_HEAP_SHARD_AFTER_CONTENDED times within
+ * USER_HEAP_SHARD_WINDOW_NS, the heap is split into one shard per
+ * CPU and allocations go to the shard for the CPU that the caller is
+ * running on. The count starts over with each window, so a heap that
+ * is only contended now and then is never split. A shard is a heap_t
+ * of its own, with its own blocks and lock, that shares the parent's
+ * handle. Like a new user heap, it starts out small. Blocks point at
+ * the shard they came from, so frees go straight there, and the
+ * parent keeps whatever it had allocated before the split.
+ * Reset, destroy and the statistics cover the parent and its shards
+ * as one heap.
+ */
+#define USER_HEAP_SHARD_AFTER_CONTENDED (32)
+#define USER_HEAP_SHARD_WINDOW_NS       (10000000ULL)
+#define USER_HEAPS_INITIAL_CAPACITY (64)
+#define USER_HEAP_TOMBSTONE         ((heap_t*)1)
 
-internal hash_table(heap_handle_t, heap_t) user_heaps;
+typedef struct {
+    u64     hash;
+    heap_t *heap;
+} user_heap_entry_t;
+
+typedef struct {
+    u64               capacity;
+    u64               n_entries;
+    u64               n_live;
+    user_heap_entry_t entries[];
+} user_heap_table_t;
+
+typedef struct user_heap {
+    heap_t            heap;
+    heap_t           *shards;
+    u32               n_shards;
+    u32               n_contended;
+    u64               contended_since;
+    struct user_heap *next_dead;
+    u64               handle_cap;
+    char              handle_buff[];
+} user_heap_t;
+
+internal user_heap_table_t *user_heaps;
+internal user_heap_t       *dead_user_heaps;
+
+#define USER_HEAPS_TRAVERSE(heap_ptr)                                              \
+    for (user_heap_table_t *_uh_table = __atomic_load_n(&user_heaps, __ATOMIC_ACQUIRE); \
+         _uh_table != NULL;                                                        \
+         _uh_table = NULL)                                                         \
+    for (u64 _uh_it = 0; _uh_it < _uh_table->capacity; _uh_it += 1)                 \
+        if (((heap_ptr) = __atomic_load_n(&_uh_table->entries[_uh_it].heap,        \
+                                          __ATOMIC_ACQUIRE)) != NULL               \
+        &&  (heap_ptr) != USER_HEAP_TOMBSTONE)
 
 pthread_mutex_t user_heaps_lock = PTHREAD_MUTEX_INITIALIZER;
 #define USER_HEAPS_LOCK()   HMALLOC_MTX_LOCKER(&user_heaps_lock)
@@ -179,5 +414,10 @@ pthread_mutex_t user_heaps_lock = PTHREAD_MUTEX_INITIALIZER;
 
 internal void user_heaps_init(void);
 internal heap_t * get_or_make_user_heap(char *handle);
+internal heap_t * get_or_make_user_heap_with_attr(char *handle, const hmalloc_heap_attr_t *attr);
+internal void remove_user_heap(heap_t *heap);
+internal void make_user_heap_shards(user_heap_t *uh);
+internal void free_user_heap_shards(user_heap_t *uh);
+internal void recycle_user_heap(heap_t *heap);
 
 #endif
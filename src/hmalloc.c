@@ -6,9 +6,17 @@
 #include "FormatString.c"
 #include "internal.c"
 #include "internal_malloc.c"
+#include "lock.c"
 #include "heap.c"
 #include "thread.c"
+#include "shared_heap.c"
+#include "bump_heap.c"
+#include "pool.c"
+#include "epoch.c"
 #include "os.c"
+#include "small_heap.c"
+#include "page_map.c"
+#include "prefetch.c"
 #include "init.c"
 #include "profile.c"
 
@@ -29,9 +37,11 @@ external void *hmalloc_malloc(size_t n_bytes) {
         return imalloc(n_bytes);
     }
 
-    heap = acquire_this_thread_heap();
+    heap = acquire_default_heap();
     addr = heap_alloc(heap, n_bytes);
-    release_heap(heap);
+    release_default_heap(heap);
+
+    if (unlikely(addr == NULL && n_bytes > 0))    { errno = ENOMEM; }
 
     return addr;
 }
@@ -47,6 +57,8 @@ external void * hmalloc_calloc(size_t count, size_t n_bytes) {
     new_n_bytes = count * n_bytes;
     addr        = hmalloc_malloc(new_n_bytes);
 
+    if (unlikely(addr == NULL))    { return NULL; }
+
     memset(addr, 0, new_n_bytes);
 
     return addr;
@@ -84,6 +96,10 @@ external void * hmalloc_realloc(void *addr, size_t n_bytes) {
             }
 
             new_addr = hmalloc_malloc(n_bytes);
+
+            /* The original allocation is left untouched on failure. */
+            if (unlikely(new_addr == NULL))    { return NULL; }
+
             memcpy(new_addr, addr, old_size);
         }
 
@@ -105,9 +121,9 @@ external void * hmalloc_valloc(size_t n_bytes) {
         return ivalloc(n_bytes);
     }
 
-    heap = acquire_this_thread_heap();
+    heap = acquire_default_heap();
     addr = heap_aligned_alloc(heap, n_bytes, system_info.page_size);
-    release_heap(heap);
+    release_default_heap(heap);
 
     return addr;
 }
@@ -131,15 +147,34 @@ external void hmalloc_free(void *addr) {
 
     block = ADDR_PARENT_BLOCK(addr);
 
-    if (block->heap__meta.flags & HEAP_THREAD) {
-        heap = acquire_thread_heap(block->heap__meta.tid);
-    } else if (block->heap__meta.flags & HEAP_USER) {
-        heap = acquire_user_heap(block->heap__meta.handle);
-    } else {
-        heap = NULL;
-        ASSERT(0, "invalid block->heap__meta.flags\n");
+    if (unlikely(block == NULL)) {
+        /* Not ours. Leave it alone rather than corrupt a heap. */
+        LOG("ignoring free of foreign pointer %p\n", addr);
+        return;
+    }
+
+    if (likely(block->heap__meta.flags & HEAP_THREAD)) {
+        thread_heap_free(block, addr);
+        return;
+    }
+
+    if (block->heap__meta.flags & HEAP_POOL) {
+        pool_free((pool_t*)block->heap, block, addr);
+        return;
+    }
+
+    /* Bump heap memory only comes back when the heap is rewound. */
+    if (unlikely(block->heap__meta.flags & HEAP_BUMP)) {
+        return;
     }
-    heap_free(heap, addr);
+
+    ASSERT(block->heap__meta.flags & (HEAP_SHARED | HEAP_USER), "invalid block->heap__meta.flags\n");
+
+    /* Shared and user heaps never give their blocks away. */
+    heap = block->heap;
+
+    HEAP_LOCK(heap);
+    heap_free(heap, block, addr);
     release_heap(heap);
 }
 
@@ -155,9 +190,9 @@ external int hmalloc_posix_memalign(void **memptr, size_t alignment, size_t n_by
         return EINVAL;
     }
 
-    heap    = acquire_this_thread_heap();
+    heap    = acquire_default_heap();
     *memptr = heap_aligned_alloc(heap, n_bytes, alignment);
-    release_heap(heap);
+    release_default_heap(heap);
 
     if (unlikely(*memptr == NULL))    { return ENOMEM; }
     return 0;
@@ -171,9 +206,9 @@ external void * hmalloc_aligned_alloc(size_t alignment, size_t size) {
         return ialigned_alloc(alignment, size);
     }
 
-    heap = acquire_this_thread_heap();
+    heap = acquire_default_heap();
     addr = heap_aligned_alloc(heap, size, alignment);
-    release_heap(heap);
+    release_default_heap(heap);
 
     return addr;
 }
@@ -192,6 +227,10 @@ external size_t hmalloc_malloc_size(void *addr) {
 
     block = ADDR_PARENT_BLOCK(addr);
 
+    if (unlikely(block == NULL)) {
+        return 0;
+    }
+
     if (likely(block->block_kind == BLOCK_KIND_CBLOCK)) {
         chunk = CHUNK_FROM_USER_MEM(addr);
 
@@ -205,6 +244,12 @@ external size_t hmalloc_malloc_size(void *addr) {
         return CHUNK_SIZE(chunk);
     } else if (likely(block->block_kind == BLOCK_KIND_SBLOCK)) {
         return SBLOCK_SLOT_SIZE;
+    } else if (block->block_kind == BLOCK_KIND_OBLOCK) {
+        return oblock_alloc_size(&(block->o), addr);
+    } else if (block->block_kind == BLOCK_KIND_BBLOCK) {
+        return BUMP_ALLOC_SIZE(addr);
+    } else if (block->block_kind == BLOCK_KIND_PBLOCK) {
+        return ((pool_t*)block->heap)->stride;
     }
 
     ASSERT(0, "couldn't determine size of allocation");
@@ -213,37 +258,63 @@ external size_t hmalloc_malloc_size(void *addr) {
 }
 
 
-external void * hmalloc(heap_handle_t h, size_t n_bytes) {
+external hmalloc_heap_t * hmalloc_heap_open(const char *name) {
+    /* Ensure our system is initialized. */
+    hmalloc_init();
+
+    return (hmalloc_heap_t*)get_or_make_user_heap((char*)name);
+}
+
+external void hmalloc_heap_attr_init(hmalloc_heap_attr_t *attr) {
+    attr->flags        = 0;
+    attr->numa_node    = -1;
+    attr->max_retained = 0;
+}
+
+external hmalloc_heap_t * hmalloc_heap_open_with_attr(const char *name, const hmalloc_heap_attr_t *attr) {
+    /* Ensure our system is initialized. */
+    hmalloc_init();
+
+    return (hmalloc_heap_t*)get_or_make_user_heap_with_attr((char*)name, attr);
+}
+
+external void * hmalloc_h(hmalloc_heap_t *h, size_t n_bytes) {
     heap_t *heap;
     void   *addr;
 
-    heap = acquire_user_heap(h);
+    if (unlikely(((heap_t*)h)->__meta.flags & HEAP_BUMP)) {
+        return bump_heap_alloc((heap_t*)h, n_bytes);
+    }
+
+    heap = acquire_user_heap_object((heap_t*)h);
     addr = heap_alloc(heap, n_bytes);
     release_heap(heap);
 
     return addr;
 }
 
-external void * hcalloc(heap_handle_t h, size_t count, size_t n_bytes) {
+external void * hcalloc_h(hmalloc_heap_t *h, size_t count, size_t n_bytes) {
     void *addr;
     u64   new_n_bytes;
 
     new_n_bytes = count * n_bytes;
-    addr        = hmalloc(h, new_n_bytes);
+    addr        = hmalloc_h(h, new_n_bytes);
+
+    if (unlikely(addr == NULL))    { return NULL; }
 
     memset(addr, 0, new_n_bytes);
 
     return addr;
 }
 
-external void * hrealloc(heap_handle_t h, void *addr, size_t n_bytes) {
+external void * hrealloc_h(hmalloc_heap_t *h, void *addr, size_t n_bytes) {
     void *new_addr;
     u64   old_size;
 
     new_addr = NULL;
 
     if (addr == NULL) {
-        new_addr = hmalloc(h, n_bytes);
+        new_addr = hmalloc_h(h, n_bytes);
     } else {
         if (likely(n_bytes > 0)) {
             old_size = hmalloc_malloc_size(addr);
@@ -263,7 +334,11 @@ external void * hrealloc(heap_handle_t h, void *addr, size_t n_bytes) {
                 return addr;
             }
 
-            new_addr = hmalloc(h, n_bytes);
+            new_addr = hmalloc_h(h, n_bytes);
+
+            /* The original allocation is left untouched on failure. */
+            if (unlikely(new_addr == NULL))    { return NULL; }
+
             memcpy(new_addr, addr, old_size);
         }
 
@@ -273,6 +348,135 @@ external void * hrealloc(heap_handle_t h, void *addr, size_t n_bytes) {
     return new_addr;
 }
 
+/* Empty a user heap and its shards. */
+internal void user_heap_release_all(heap_t *heap, int and_spares) {
+    user_heap_t *uh;
+    heap_t      *shards;
+    u32          i;
+
+    uh     = (user_heap_t*)heap;
+    shards = __atomic_load_n(&uh->shards, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i <= (shards ? uh->n_shards : 0); i += 1) {
+        heap = i == 0 ? &uh->heap : shards + (i - 1);
+
+        HEAP_LOCK(heap);
+        heap_release_all_blocks(heap);
+        if (and_spares) {
+            /* Keep nothing back for later this time. */
+            heap->attr.max_retained = 0;
+            heap_release_empty_blocks(heap);
+        }
+        release_heap(heap);
+    }
+}
+
+external void hmalloc_heap_reset(hmalloc_heap_t *h) {
+    if (((heap_t*)h)->__meta.flags & HEAP_BUMP) {
+        bump_heap_rewind((heap_t*)h, NULL, NULL);
+        return;
+    }
+
+    user_heap_release_all((heap_t*)h, 0);
+}
+
+external void hmalloc_heap_destroy(hmalloc_heap_t *h) {
+    heap_t *heap;
+
+    heap = (heap_t*)h;
+
+    if (heap->__meta.flags & HEAP_BUMP) {
+        bump_heap_free(heap);
+        return;
+    }
+
+    remove_user_heap(heap);
+
+    /* The spares go too this time. */
+    user_heap_release_all(heap, 1);
+    free_user_heap_shards((user_heap_t*)heap);
+
+    recycle_user_heap(heap);
+}
+
+external hmalloc_heap_t * hmalloc_arena_create(void) {
+    /* Ensure our system is initialized. */
+    hmalloc_init();
+
+    return (hmalloc_heap_t*)bump_heap_new();
+}
+
+external hmalloc_arena_mark_t hmalloc_arena_mark(hmalloc_heap_t *h) {
+    heap_t               *heap;
+    hmalloc_arena_mark_t  mark;
+
+    heap = (heap_t*)h;
+
+    ASSERT(heap->__meta.flags & HEAP_BUMP, "hmalloc_arena_mark() on a heap that isn't an arena");
+
+    mark.__block = heap->bblocks_tail;
+    mark.__top   = heap->bblocks_tail ? heap->bblocks_tail->top : NULL;
+
+    return mark;
+}
+
+external void hmalloc_arena_rewind(hmalloc_heap_t *h, hmalloc_arena_mark_t mark) {
+    heap_t *heap;
+
+    heap = (heap_t*)h;
+
+    ASSERT(heap->__meta.flags & HEAP_BUMP, "hmalloc_arena_rewind() on a heap that isn't an arena");
+
+    bump_heap_rewind(heap, mark.__block, mark.__top);
+}
+
+external hmalloc_pool_t * hmalloc_pool_create(const char *name, size_t obj_size, size_t align,
+                                              void (*ctor)(void *obj), void (*dtor)(void *obj)) {
+    /* Ensure our system is initialized. */
+    hmalloc_init();
+
+    return (hmalloc_pool_t*)pool_new(name, obj_size, align, ctor, dtor);
+}
+
+external void * hmalloc_pool_alloc(hmalloc_pool_t *pool) {
+    return pool_alloc((pool_t*)pool);
+}
+
+external void hmalloc_pool_destroy(hmalloc_pool_t *pool) {
+    pool_destroy((pool_t*)pool);
+}
+
+external void * hmalloc(heap_handle_t h, size_t n_bytes) {
+    hmalloc_heap_t *heap;
+
+    heap = hmalloc_heap_open(h);
+
+    if (unlikely(heap == NULL))    { return NULL; }
+
+    return hmalloc_h(heap, n_bytes);
+}
+
+external void * hcalloc(heap_handle_t h, size_t count, size_t n_bytes) {
+    hmalloc_heap_t *heap;
+
+    heap = hmalloc_heap_open(h);
+
+    if (unlikely(heap == NULL))    { return NULL; }
+
+    return hcalloc_h(heap, count, n_bytes);
+}
+
+external void * hrealloc(heap_handle_t h, void *addr, size_t n_bytes) {
+    hmalloc_heap_t *heap;
+
+    heap = hmalloc_heap_open(h);
+
+    /* Like realloc(), leave addr alone if there's no memory. */
+    if (unlikely(heap == NULL))    { return NULL; }
+
+    return hrealloc_h(heap, addr, n_bytes);
+}
+
 external void * hreallocf(heap_handle_t h, void *addr, size_t n_bytes) {
     return hrealloc(h, addr, n_bytes);
 }
@@ -282,6 +486,9 @@ external void * hvalloc(heap_handle_t h, size_t n_bytes) {
     void   *addr;
 
     heap = acquire_user_heap(h);
+
+    if (unlikely(heap == NULL))    { return NULL; }
+
     addr = heap_aligned_alloc(heap, n_bytes, system_info.page_size);
     release_heap(heap);
 
@@ -303,7 +510,10 @@ external int hposix_memalign(heap_handle_t h, void **memptr, size_t alignment, s
         return EINVAL;
     }
 
-    heap    = acquire_user_heap(h);
+    heap = acquire_user_heap(h);
+
+    if (unlikely(heap == NULL))    { return ENOMEM; }
+
     *memptr = heap_aligned_alloc(heap, size, alignment);
     release_heap(heap);
 
@@ -316,6 +526,9 @@ external void * haligned_alloc(heap_handle_t h, size_t alignment, size_t size) {
     void   *addr;
 
     heap = acquire_user_heap(h);
+
+    if (unlikely(heap == NULL))    { return NULL; }
+
     addr = heap_aligned_alloc(heap, size, alignment);
     release_heap(heap);
 
@@ -326,6 +539,66 @@ external void * hmemalign(heap_handle_t h, size_t alignment, size_t size) {
     return haligned_alloc(h, alignment, size);
 }
 
+external int hmalloc_set_page_provider(heap_handle_t h, hmalloc_page_provider_t *provider) {
+    heap_t                  *heap;
+    hmalloc_page_provider_t *old_provider;
+    void                    *old_spare;
+    int                      err;
+
+    hmalloc_init();
+
+    err       = 0;
+    heap      = get_or_make_user_heap(h);
+    old_spare = NULL;
+
+    if (unlikely(heap == NULL))    { return ENOMEM; }
+
+    HEAP_LOCK(heap);
+
+    old_provider = heap->provider;
+
+    /*
+     * Blocks are returned to the provider they came from, but the
+     * cached big chunks belong to the heap.
+     * Only allow a switch before the heap has any memory, other than
+     * the spare that a heap with page attributes is made with. That
+     * goes back to the old provider.
+     * Shards copy the provider when they are made, so it's too late
+     * once there are any.
+     */
+    if (heap->cblocks_head           != NULL
+    ||  heap->oblocks_head           != NULL
+    ||  heap->big_chunk_cblocks_tail != NULL
+    ||  heap->big_chunk_cblocks_live != NULL
+    ||  ((user_heap_t*)heap)->shards != NULL
+#ifdef HMALLOC_USE_SBLOCKS
+    ||  heap->sblocks_head           != NULL
+#endif
+    ||  heap->retained               != NULL) {
+        err = EBUSY;
+    } else {
+        old_spare      = __atomic_exchange_n(&heap->spare_block, NULL, __ATOMIC_ACQUIRE);
+        heap->provider = provider ? provider : default_page_provider;
+
+        /* Small heap slices don't come from the heap's provider. */
+        if (heap->provider != &os_page_provider) {
+            heap->small_slices_left = 0;
+        }
+    }
+
+    release_heap(heap);
+
+    if (old_spare != NULL) {
+        old_provider->free_pages(old_provider->ctx, old_spare, DEFAULT_BLOCK_SIZE);
+    }
+
+    if (err == 0 && HEAP_HAS_PAGE_ATTR(heap)) {
+        heap_refill_spare(heap);
+    }
+
+    return err;
+}
+
 size_t hmalloc_size(void *addr) {
     return hmalloc_malloc_size(addr);
 }
@@ -342,12 +615,41 @@ do {                                                   \
                                                        \
         _block = ADDR_PARENT_BLOCK((addr));            \
                                                        \
-        if (_block->block_kind == BLOCK_KIND_CBLOCK) { \
+        if (_block != NULL                             \
+        &&  _block->block_kind == BLOCK_KIND_CBLOCK) { \
             profile_set_site(_block, (site));          \
         }                                              \
     }                                                  \
 } while (0)
 
+external hmalloc_heap_t * hmalloc_site_resolve(hmalloc_site_t *site, const char *name) {
+    hmalloc_heap_t *heap;
+
+    /*
+     * Have to make sure that we are initialized so that
+     * hmalloc_site_layout has a proper value.
+     */
+    hmalloc_init();
+
+    /* The layout can't change, so don't come back here for this site. */
+    if (hmalloc_site_layout == HMALLOC_SITE_LAYOUT_THREAD) {
+        __atomic_store_n(&site->heap, HMALLOC_SITE_THREAD_HEAP, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if (hmalloc_site_layout != HMALLOC_SITE_LAYOUT_SITE) {
+        return NULL;
+    }
+
+    heap = hmalloc_heap_open(name);
+
+    LOG("resolved site descriptor for '%s' to heap %p\n", name, heap);
+
+    __atomic_store_n(&site->heap, heap, __ATOMIC_RELEASE);
+
+    return heap;
+}
+
 void * hmalloc_site_malloc(char *site, size_t n_bytes) {
     void *addr;
 
@@ -3,6 +3,10 @@
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef char *heap_handle_t;
 
 void * hmalloc_malloc(size_t n_bytes);
@@ -28,6 +32,126 @@ void * hmemalign(heap_handle_t h, size_t alignment, size_t size);
 size_t hmalloc_size(void *addr);
 size_t hmalloc_usable_size(void *addr);
 
+/*
+ * Heap objects.
+ *
+ * hmalloc_heap_open() looks up (or creates) the user heap with the
+ * given name once and returns a pointer to it that stays valid for
+ * the life of the process. The *_h functions take that pointer
+ * instead of a name, so they skip the global heap table entirely.
+ * Memory from them is freed with hfree() or free() as usual.
+ * hmalloc_heap_open() returns NULL if the heap doesn't exist and
+ * there isn't the memory to make it. The functions above that take
+ * a name then fail the same way as when the allocation itself
+ * can't be satisfied: they return NULL, or ENOMEM from
+ * hposix_memalign().
+ */
+typedef struct hmalloc_heap hmalloc_heap_t;
+
+hmalloc_heap_t * hmalloc_heap_open(const char *name);
+void * hmalloc_h(hmalloc_heap_t *heap, size_t n_bytes);
+void * hcalloc_h(hmalloc_heap_t *heap, size_t count, size_t n_bytes);
+void * hrealloc_h(hmalloc_heap_t *heap, void *addr, size_t n_bytes);
+
+/*
+ * Heap attributes.
+ *
+ * hmalloc_heap_open_with_attr() is hmalloc_heap_open() for a heap
+ * whose pages should behave differently from the default. The
+ * attributes are applied to every block that the heap gets from its
+ * page provider:
+ *     HMALLOC_HEAP_HUGE_PAGES    -- ask for transparent huge pages
+ *     HMALLOC_HEAP_NO_HUGE_PAGES -- ask for no huge pages
+ *     HMALLOC_HEAP_MLOCK         -- mlock() the blocks, so that the
+ *                                   heap never page faults
+ *     HMALLOC_HEAP_PREFAULT      -- fault blocks in up front
+ *     numa_node                  -- bind the blocks to a NUMA node
+ *                                   (-1 for no binding)
+ * max_retained is how many empty blocks the heap keeps rather than
+ * giving them back to the provider (0, the default, keeps none;
+ * HMALLOC_HEAP_RETAIN_ALL never gives memory back). Kept blocks are
+ * purged, unless the heap is mlock()ed, and are reused before
+ * asking the provider for more.
+ * The attributes are only set if the call creates the heap. Opening
+ * a heap that already exists returns it as it is.
+ * hmalloc_heap_attr_init() fills in the defaults.
+ */
+#define HMALLOC_HEAP_HUGE_PAGES    (0x1)
+#define HMALLOC_HEAP_NO_HUGE_PAGES (0x2)
+#define HMALLOC_HEAP_MLOCK         (0x4)
+#define HMALLOC_HEAP_PREFAULT      (0x8)
+
+#define HMALLOC_HEAP_RETAIN_ALL    (~0U)
+
+typedef struct {
+    unsigned flags;
+    int      numa_node;
+    unsigned max_retained;
+} hmalloc_heap_attr_t;
+
+void             hmalloc_heap_attr_init(hmalloc_heap_attr_t *attr);
+hmalloc_heap_t * hmalloc_heap_open_with_attr(const char *name, const hmalloc_heap_attr_t *attr);
+
+/*
+ * hmalloc_heap_reset() frees everything that was allocated from a
+ * heap at once, in time proportional to the number of blocks the heap
+ * has rather than the number of allocations.
+ * hmalloc_heap_destroy() does the same and also removes the heap, so
+ * that the pointer is no longer valid and opening the name again
+ * gives a new, empty heap.
+ * In both cases, every pointer into the heap becomes invalid, and
+ * nothing may be using the heap at the same time (including as a
+ * pushed default heap).
+ */
+void hmalloc_heap_reset(hmalloc_heap_t *heap);
+void hmalloc_heap_destroy(hmalloc_heap_t *heap);
+
+/*
+ * Arenas.
+ *
+ * An arena is a heap that allocates by bumping a pointer and ignores
+ * frees. hmalloc_arena_mark() returns a savepoint and
+ * hmalloc_arena_rewind() frees everything that was allocated from
+ * the arena after it (including anything allocated after marks made
+ * since, which are no longer valid).
+ * Allocate from an arena with hmalloc_h() and friends. hfree() and
+ * free() of arena memory do nothing, and hmalloc_heap_reset() and
+ * hmalloc_heap_destroy() work as they do for any heap.
+ * An arena must only be used by one thread at a time.
+ */
+typedef struct {
+    void *__block;
+    void *__top;
+} hmalloc_arena_mark_t;
+
+hmalloc_heap_t *     hmalloc_arena_create(void);
+hmalloc_arena_mark_t hmalloc_arena_mark(hmalloc_heap_t *arena);
+void                 hmalloc_arena_rewind(hmalloc_heap_t *arena, hmalloc_arena_mark_t mark);
+
+/*
+ * Object pools.
+ *
+ * hmalloc_pool_create() makes a cache of objects of obj_size bytes
+ * aligned to align (a power of two no bigger than the page size, or
+ * 0 for 8). Objects are packed into slots of exactly that size.
+ * ctor, if it isn't NULL, is run on an object the first time that
+ * its memory is handed out. Objects are freed with hfree() or free(),
+ * and must be back in their constructed state when they are, since
+ * the next hmalloc_pool_alloc() that gets one skips ctor.
+ * dtor, if it isn't NULL, is run when the pool gives the memory of
+ * a constructed object back. ctor and dtor must not use the pool.
+ * hmalloc_pool_destroy() destroys every constructed object and frees
+ * the pool. Every object must have been freed by then.
+ * hmalloc_pool_create() returns NULL if obj_size is 0 or bigger than
+ * 256 KiB, or if align isn't allowed. The name is only for logs.
+ */
+typedef struct hmalloc_pool hmalloc_pool_t;
+
+hmalloc_pool_t * hmalloc_pool_create(const char *name, size_t obj_size, size_t align,
+                                     void (*ctor)(void *obj), void (*dtor)(void *obj));
+void *           hmalloc_pool_alloc(hmalloc_pool_t *pool);
+void             hmalloc_pool_destroy(hmalloc_pool_t *pool);
+
 void * hmalloc_site_malloc(char *site, size_t n_bytes);
 void * hmalloc_site_calloc(char *site, size_t count, size_t n_bytes);
 void * hmalloc_site_realloc(char *site, void *addr, size_t n_bytes);
@@ -41,6 +165,252 @@ void * hmalloc_site_memalign(char *site, size_t alignment, size_t size);
 size_t hmalloc_site_malloc_size(void *addr);
 size_t hmalloc_site_malloc_usable_size(void *addr);
 
+/*
+ * Allocation-site descriptors.
+ *
+ * The hmalloc_site_* functions above look the site up by name on
+ * every call. HMALLOC_SITE_MALLOC() and friends instead keep a static
+ * descriptor at each call site, named after __FILE__ and __LINE__.
+ * The first call resolves the site's heap and caches it in the
+ * descriptor; after that, allocating is a load and a call to
+ * hmalloc_h(). When HMALLOC_SITE_LAYOUT is "thread", there is no heap
+ * to cache, so the first call caches HMALLOC_SITE_THREAD_HEAP
+ * instead, and later calls go straight to the hmalloc_site_*
+ * functions without resolving the site again.
+ * A site's heap must not be destroyed with hmalloc_heap_destroy()
+ * while its descriptor may still be used.
+ *
+ * In C, the macros use a statement expression to declare the
+ * descriptor. In C++, the descriptor is a static member of
+ * hmalloc_site_slot<ID>, where ID is a constexpr hash of the site
+ * name, and HMALLOC_SITE_NEW(T, count) allocates count objects of
+ * type T (without constructing them).
+ */
+typedef struct {
+    hmalloc_heap_t *heap;
+} hmalloc_site_t;
+
+#define HMALLOC_SITE_THREAD_HEAP ((hmalloc_heap_t*)1)
+
+#define HMALLOC_SITE_STR2(x) #x
+#define HMALLOC_SITE_STR(x)  HMALLOC_SITE_STR2(x)
+#define HMALLOC_SITE_NAME    (__FILE__ ":" HMALLOC_SITE_STR(__LINE__))
+
+hmalloc_heap_t * hmalloc_site_resolve(hmalloc_site_t *site, const char *name);
+
+static inline hmalloc_heap_t * hmalloc_site_heap(hmalloc_site_t *site, const char *name) {
+    hmalloc_heap_t *heap;
+
+    heap = __atomic_load_n(&site->heap, __ATOMIC_ACQUIRE);
+
+    if (heap == HMALLOC_SITE_THREAD_HEAP)    { return NULL; }
+
+    if (__builtin_expect(heap == NULL, 0)) {
+        heap = hmalloc_site_resolve(site, name);
+    }
+
+    return heap;
+}
+
+static inline void * hmalloc_site_malloc_at(hmalloc_site_t *site, const char *name, size_t n_bytes) {
+    hmalloc_heap_t *heap;
+
+    heap = hmalloc_site_heap(site, name);
+
+    if (heap == NULL)    { return hmalloc_site_malloc((char*)name, n_bytes); }
+
+    return hmalloc_h(heap, n_bytes);
+}
+
+static inline void * hmalloc_site_calloc_at(hmalloc_site_t *site, const char *name, size_t count, size_t n_bytes) {
+    hmalloc_heap_t *heap;
+
+    heap = hmalloc_site_heap(site, name);
+
+    if (heap == NULL)    { return hmalloc_site_calloc((char*)name, count, n_bytes); }
+
+    return hcalloc_h(heap, count, n_bytes);
+}
+
+static inline void * hmalloc_site_realloc_at(hmalloc_site_t *site, const char *name, void *addr, size_t n_bytes) {
+    hmalloc_heap_t *heap;
+
+    heap = hmalloc_site_heap(site, name);
+
+    if (heap == NULL)    { return hmalloc_site_realloc((char*)name, addr, n_bytes); }
+
+    return hrealloc_h(heap, addr, n_bytes);
+}
+
+#ifdef __cplusplus
+extern "C++" {
+
+/* 64-bit FNV-1a. C++11 constexpr functions can only recurse. */
+constexpr unsigned long long hmalloc_site_hash(const char *s, unsigned long long h = 14695981039346656037ULL) {
+    return *s == 0 ? h : hmalloc_site_hash(s + 1, (h ^ (unsigned char)*s) * 1099511628211ULL);
+}
+
+template <unsigned long long ID>
+struct hmalloc_site_slot {
+    static hmalloc_site_t site;
+};
+
+template <unsigned long long ID>
+hmalloc_site_t hmalloc_site_slot<ID>::site;
+
+template <typename T, unsigned long long ID>
+inline T * hmalloc_site_new(const char *name, size_t count) {
+    return static_cast<T*>(hmalloc_site_calloc_at(&hmalloc_site_slot<ID>::site, name, count, sizeof(T)));
+}
+
+#define HMALLOC_SITE_DESC \
+    (&hmalloc_site_slot<hmalloc_site_hash(HMALLOC_SITE_NAME)>::site)
+
+#define HMALLOC_SITE_MALLOC(n_bytes) \
+    (hmalloc_site_malloc_at(HMALLOC_SITE_DESC, HMALLOC_SITE_NAME, (n_bytes)))
+#define HMALLOC_SITE_CALLOC(count, n_bytes) \
+    (hmalloc_site_calloc_at(HMALLOC_SITE_DESC, HMALLOC_SITE_NAME, (count), (n_bytes)))
+#define HMALLOC_SITE_REALLOC(addr, n_bytes) \
+    (hmalloc_site_realloc_at(HMALLOC_SITE_DESC, HMALLOC_SITE_NAME, (addr), (n_bytes)))
+#define HMALLOC_SITE_NEW(T, count) \
+    (hmalloc_site_new<T, hmalloc_site_hash(HMALLOC_SITE_NAME)>(HMALLOC_SITE_NAME, (count)))
+
+}
+#else
+
+#define HMALLOC_SITE_AT(call, ...)                         \
+({                                                         \
+    static hmalloc_site_t __hmalloc_site;                  \
+    call(&__hmalloc_site, HMALLOC_SITE_NAME, __VA_ARGS__); \
+})
+
+#define HMALLOC_SITE_MALLOC(n_bytes) \
+    HMALLOC_SITE_AT(hmalloc_site_malloc_at, (n_bytes))
+#define HMALLOC_SITE_CALLOC(count, n_bytes) \
+    HMALLOC_SITE_AT(hmalloc_site_calloc_at, (count), (n_bytes))
+#define HMALLOC_SITE_REALLOC(addr, n_bytes) \
+    HMALLOC_SITE_AT(hmalloc_site_realloc_at, (addr), (n_bytes))
+
+#endif
+
+/*
+ * Page providers supply the memory that heaps carve blocks from.
+ *
+ * alloc_pages must return n_bytes of zeroed, readable and writable
+ * memory aligned to alignment, or NULL.
+ * purge tells the provider that the contents of a range are no
+ * longer needed (but the range stays mapped).
+ * commit asks for a range to be made resident ahead of use.
+ * purge and commit return 0 on success.
+ *
+ * The default provider uses mmap().
+ */
+typedef struct hmalloc_page_provider {
+    void * (*alloc_pages)(void *ctx, size_t n_bytes, size_t alignment);
+    void   (*free_pages)(void *ctx, void *addr, size_t n_bytes);
+    int    (*purge)(void *ctx, void *addr, size_t n_bytes);
+    int    (*commit)(void *ctx, void *addr, size_t n_bytes);
+    void   *ctx;
+} hmalloc_page_provider_t;
+
+/*
+ * A provider that forwards to another provider, counts the calls
+ * made to it, and can be told to fail allocations.
+ * alloc_pages returns NULL for every call after the first fail_after
+ * calls (0 means never), and for the next fail_next calls.
+ */
+typedef struct {
+    hmalloc_page_provider_t  provider;
+    hmalloc_page_provider_t *backing;
+    unsigned long            n_alloc_calls;
+    unsigned long            n_free_calls;
+    unsigned long            n_purge_calls;
+    unsigned long            n_commit_calls;
+    unsigned long            n_alloc_failures;
+    unsigned long            fail_after;
+    unsigned long            fail_next;
+} hmalloc_counting_page_provider_t;
+
+hmalloc_page_provider_t * hmalloc_default_page_provider(void);
+void hmalloc_set_default_page_provider(hmalloc_page_provider_t *provider);
+int  hmalloc_set_page_provider(heap_handle_t h, hmalloc_page_provider_t *provider);
+void hmalloc_counting_page_provider_init(hmalloc_counting_page_provider_t *counting,
+                                         hmalloc_page_provider_t *backing);
+
+/*
+ * Heap contexts for user-space schedulers.
+ *
+ * A context owns a heap the same way a thread does, but isn't tied
+ * to a thread. Switch a fiber's context in when the fiber is resumed
+ * and out (switch to NULL) when it is suspended; while it is
+ * installed, malloc() and free() on that thread use the context's
+ * heap. A context must only be installed on one thread at a time.
+ * hmalloc_context_switch() returns the context that was installed.
+ * Destroying a context keeps its live allocations valid.
+ */
+typedef struct hmalloc_context hmalloc_context_t;
+
+hmalloc_context_t * hmalloc_context_create(void);
+void                hmalloc_context_destroy(hmalloc_context_t *ctx);
+hmalloc_context_t * hmalloc_context_switch(hmalloc_context_t *ctx);
+
+/*
+ * Per-heap statistics.
+ *
+ * hmalloc_get_heap_stats() fills in up to max_stats entries and
+ * returns how many heaps there are, so it can be called with 0 first
+ * to size the array. The lock counts are only recorded when the
+ * HMALLOC_LOCK_STATS environment variable is set, and they are read
+ * without taking the locks, so they may be slightly stale.
+ * Thread heaps are never locked; their lock counts stay at zero.
+ * n_os_allocs is how many times the heap asked its page provider for
+ * memory.
+ */
+#define HMALLOC_HEAP_KIND_THREAD (0x1)
+#define HMALLOC_HEAP_KIND_USER   (0x2)
+#define HMALLOC_HEAP_KIND_SHARED (0x4)
+
+typedef struct {
+    const char    *handle;      /* User heaps only. */
+    unsigned       kind;
+    unsigned       id;          /* Thread id or shared heap index. */
+    unsigned long  n_acquires;
+    unsigned long  n_contended;
+    unsigned long  wait_ns;
+    unsigned long  n_os_allocs;
+} hmalloc_heap_stats_t;
+
+size_t hmalloc_get_heap_stats(hmalloc_heap_stats_t *stats, size_t max_stats);
+
+/*
+ * Deferred frees for lock-free data structures.
+ *
+ * Readers wrap their accesses in hmalloc_epoch_enter() and
+ * hmalloc_epoch_exit() (which nest). Memory that has been unlinked
+ * from a structure is passed to hmalloc_free_deferred() and is only
+ * really freed once every critical section that was running when it
+ * was retired has ended. Critical sections must not span a call to
+ * hmalloc_context_switch().
+ */
+void hmalloc_epoch_enter(void);
+void hmalloc_epoch_exit(void);
+void hmalloc_free_deferred(void *addr);
+
+/*
+ * Scoped default heap.
+ *
+ * Between a push and its matching pop, malloc() and friends on the
+ * calling thread allocate from the user heap h instead of the
+ * thread's heap. This includes calls made by library code.
+ * Pushes nest. Pushing NULL restores the normal default heap until
+ * the matching pop. hmalloc_push_default_heap() returns 0 on success,
+ * EOVERFLOW if the thread has too many pushes outstanding, or ENOMEM
+ * if the heap h could not be made. Nothing is pushed on failure, so
+ * there's nothing to pop.
+ */
+int  hmalloc_push_default_heap(heap_handle_t h);
+void hmalloc_pop_default_heap(void);
+
 void * malloc(size_t n_bytes);
 void * calloc(size_t count, size_t n_bytes);
 void * realloc(void *addr, size_t n_bytes);
@@ -54,4 +424,8 @@ void * memalign(size_t alignment, size_t size);
 size_t malloc_size(void *addr);
 size_t malloc_usable_size(void *addr);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -3,6 +3,9 @@
 #include "os.h"
 #include "thread.h"
 #include "profile.h"
+#include "prefetch.h"
+#include "shared_heap.h"
+#include "small_heap.h"
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -40,7 +43,7 @@ internal void hmalloc_init(void) {
 #endif
             system_info_init();
 
-            LOG("main thread has tid %d\n", get_this_tid());
+            LOG("main thread has os tid %d\n", os_get_tid());
 
             hmalloc_use_imalloc = 1;
 
@@ -67,10 +70,35 @@ internal void hmalloc_init(void) {
                 LOG("missing value for HMALLOC_SITE_LAYOUT -- defaulting to HMALLOC_SITE_LAYOUT_THREAD\n");
             }
 
+            /*
+             * HMALLOC_OOB_CBLOCKS=1 makes heaps serve medium sized
+             * allocations from oblocks instead of cblocks.
+             */
+            hmalloc_use_oblocks = !!getenv("HMALLOC_OOB_CBLOCKS");
+            if (hmalloc_use_oblocks) {
+                LOG("using oblocks for medium allocations\n");
+            }
+
+            /*
+             * HMALLOC_LOCK_STATS=1 makes heap locks count how often
+             * they are taken and waited on.
+             * See hmalloc_get_heap_stats().
+             */
+            hmalloc_lock_stats = !!getenv("HMALLOC_LOCK_STATS");
+            if (hmalloc_lock_stats) {
+                LOG("recording heap lock statistics\n");
+            }
+
             threads_init();
 
+            shared_heaps_init();
+
+            small_heaps_init();
+
             user_heaps_init();
 
+            prefetch_init();
+
             profile_init();
 
             hmalloc_use_imalloc    = 0;
@@ -87,6 +115,12 @@ internal void hmalloc_fini(void) {
         profile_fini();
     }
 
+#ifdef HMALLOC_DO_LOGGING
+    if (hmalloc_is_initialized) {
+        heaps_log_stats();
+    }
+#endif
+
     /*
      * After this point, we're going to stop servicing `free`s.
      * We're shutting down, so it'll be assumed that the rest of
@@ -18,6 +18,7 @@ internal int hmalloc_is_initialized = 0;
 internal int hmalloc_use_imalloc    = 0;
 internal int hmalloc_ignore_frees   = 0;
 internal int hmalloc_site_layout    = HMALLOC_SITE_LAYOUT_UNKNOWN;
+internal int hmalloc_use_oblocks    = 0;
 
 
 internal void hmalloc_init(void);
@@ -0,0 +1,88 @@
+#include "internal.h"
+#include "lock.h"
+#include "os.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+internal void lock_init(hmalloc_lock_t *lock) {
+    lock->state       = 0;
+    lock->spin_limit  = LOCK_MAX_SPINS / 4;
+    lock->n_acquires  = 0;
+    lock->n_contended = 0;
+    lock->wait_ns     = 0;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__ ("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+internal u64 lock_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+internal void lock_acquire_slow(hmalloc_lock_t *lock) {
+    u64 start_ns;
+    u32 spin_limit,
+        max_spins,
+        spins;
+    i32 delta;
+
+    start_ns = unlikely(hmalloc_lock_stats) ? lock_now_ns() : 0;
+    spins    = 0;
+
+    if (system_info.n_cpus > 1) {
+        spin_limit = __atomic_load_n(&lock->spin_limit, __ATOMIC_RELAXED);
+        max_spins  = MIN(2 * spin_limit + 10, LOCK_MAX_SPINS);
+
+        for (; spins < max_spins; spins += 1) {
+            cpu_relax();
+
+            if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0
+            &&  lock_try_acquire(lock)) {
+                goto out;
+            }
+        }
+    }
+
+    /*
+     * Mark the lock as having sleepers and sleep until it's
+     * released. Whoever wins the exchange with 0 owns the lock, but
+     * leaves it at 2 because others may still be asleep.
+     */
+    while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+
+    if (unlikely(hmalloc_lock_stats))    { lock->n_acquires += 1; }
+
+out:;
+    if (system_info.n_cpus > 1) {
+        /*
+         * Now that we hold the lock, move the estimate an eighth of
+         * the way to what it took (all of max_spins if spinning
+         * wasn't enough). Waiters still read it while they spin, so
+         * it's accessed with relaxed atomics.
+         */
+        spin_limit = __atomic_load_n(&lock->spin_limit, __ATOMIC_RELAXED);
+        delta      = ((i32)spins - (i32)spin_limit) / 8;
+        __atomic_store_n(&lock->spin_limit, spin_limit + delta, __ATOMIC_RELAXED);
+    }
+
+    if (unlikely(hmalloc_lock_stats)) {
+        lock->n_contended += 1;
+        lock->wait_ns     += lock_now_ns() - start_ns;
+    }
+}
+
+internal void lock_wake(hmalloc_lock_t *lock) {
+    syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
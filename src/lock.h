@@ -0,0 +1,86 @@
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
+#include "internal.h"
+
+#include <time.h>
+
+/*
+ * Heap locks.
+ *
+ * Heap critical sections are short, so a heap lock first tries to
+ * take the lock with one atomic, then spins for a while, and only then
+ * sleeps on a futex. The state word is
+ *     0 -- unlocked
+ *     1 -- locked
+ *     2 -- locked and there may be sleepers,
+ * so unlocking only makes a system call when somebody is asleep.
+ *
+ * How long to spin adapts to the lock: spin_limit follows the number
+ * of spins that it has recently taken to get the lock (glibc's
+ * adaptive mutexes do the same). It is only updated by a thread that
+ * has just taken the lock. There's no point in spinning when there
+ * is only one CPU.
+ *
+ * A lock that sits in a struct next to fields that its holder
+ * writes (heap_t) is padded with LOCK_PAD on both sides. That gives
+ * the lock a cache line to itself wherever the struct was allocated,
+ * so threads spinning on it don't keep pulling the holder's fields
+ * away, and the heaps next to it in an array don't share its line.
+ * heap_t is not aligned to 64 bytes instead: heaps are embedded in
+ * structs from the internal allocator, which only aligns to 16.
+ *
+ * With HMALLOC_LOCK_STATS set, each lock also counts how many times
+ * it was taken, how many of those had to wait, and how long the
+ * waits took in total. The counts are only written by the lock
+ * holder, so they don't need atomics.
+ */
+
+#define LOCK_MAX_SPINS (200)
+#define CACHE_LINE_SIZE (64)
+#define LOCK_PAD(name)  char name[CACHE_LINE_SIZE]
+
+typedef struct {
+    u32 state;
+    u32 spin_limit;
+    u64 n_acquires;
+    u64 n_contended;
+    u64 wait_ns;
+} hmalloc_lock_t;
+
+internal int hmalloc_lock_stats;
+
+internal void lock_init(hmalloc_lock_t *lock);
+internal void lock_acquire_slow(hmalloc_lock_t *lock);
+internal void lock_wake(hmalloc_lock_t *lock);
+
+static inline int lock_try_acquire(hmalloc_lock_t *lock) {
+    u32 expected;
+
+    expected = 0;
+
+    if (__atomic_compare_exchange_n(&lock->state, &expected, 1,
+                                    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (unlikely(hmalloc_lock_stats))    { lock->n_acquires += 1; }
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline void lock_acquire(hmalloc_lock_t *lock) {
+    if (likely(lock_try_acquire(lock)))    { return; }
+
+    lock_acquire_slow(lock);
+}
+
+static inline void lock_release(hmalloc_lock_t *lock) {
+    if (unlikely(__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)) {
+        lock_wake(lock);
+    }
+}
+
+#define HMALLOC_LOCK_LOCKER(lock_ptr)   do { lock_acquire(lock_ptr); } while (0)
+#define HMALLOC_LOCK_UNLOCKER(lock_ptr) do { lock_release(lock_ptr); } while (0)
+
+#endif
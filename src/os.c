@@ -6,11 +6,23 @@
 #include <sys/mman.h>
 #if defined(__linux__)
 #include <linux/mman.h> /* linux mmap flags */
+#include <linux/mempolicy.h>
 #endif
 
 #include <unistd.h>
+#include <string.h>
+#include <sched.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#if defined(__linux__)
+#include <linux/rseq.h>
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE (23)
+#endif
+
+#define OS_MAX_NUMA_NODES (1024)
 
 
 internal void system_info_init(void) {
@@ -24,10 +36,12 @@ internal void system_info_init(void) {
 
     system_info.page_size       = page_size;
     system_info.log_2_page_size = LOG2_64BIT(page_size);
+    system_info.n_cpus          = MAX(1L, sysconf(_SC_NPROCESSORS_CONF));
 
     LOG("page_size:          %lu\n", system_info.page_size);
     LOG("MAX_SMALL_CHUNK:    %llu\n", MAX_SMALL_CHUNK);
     LOG("DEFAULT_BLOCK_SIZE: %llu\n", DEFAULT_BLOCK_SIZE);
+    LOG("n_cpus:             %u\n", system_info.n_cpus);
 
     LOG("initialized system info\n");
 }
@@ -44,13 +58,15 @@ internal void * get_pages_from_os(u64 n_pages, u64 alignment) {
 
     desired_size = (n_pages << system_info.log_2_page_size);
 
-    ASSERT(desired_size >= alignment, "alignment greater than desired memory size");
-
     /*
-     * Ask for twice the desired size so that we can get aligned
-     * memory.
+     * mmap() already gives us page alignment. For anything more,
+     * ask for enough extra that an aligned range of the desired
+     * size has to be in there somewhere.
      */
-    first_map_size = desired_size << 1ULL;
+    first_map_size = desired_size;
+    if (alignment > system_info.page_size) {
+        first_map_size += alignment - system_info.page_size;
+    }
 
     mem_start = mmap(NULL,
                 first_map_size,
@@ -64,7 +80,7 @@ internal void * get_pages_from_os(u64 n_pages, u64 alignment) {
         return NULL;
     }
 
-    aligned_start = ALIGN(mem_start, alignment);
+    aligned_start = ALIGN(mem_start, MAX(alignment, system_info.page_size));
     aligned_end   = aligned_start + desired_size;
     mem_end       = mem_start + first_map_size;
 
@@ -93,6 +109,178 @@ internal void release_pages_to_os(void *addr, u64 n_pages) {
     (void)err_code;
 }
 
+internal int madv_populate_unsupported;
+
+internal void prefault_pages(void *addr, u64 n_pages) {
+    volatile char *page;
+    u64            i;
+
+    ASSERT(n_pages > 0, "n_pages is zero");
+
+    if (!madv_populate_unsupported) {
+        if (madvise(addr, n_pages << system_info.log_2_page_size, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+
+        /*
+         * Older kernels don't know about MADV_POPULATE_WRITE.
+         * Don't bother asking again.
+         */
+        madv_populate_unsupported = 1;
+    }
+
+    /*
+     * Fault the pages in by hand. The memory is fresh from mmap(),
+     * so writing zeros doesn't change its contents.
+     */
+    for (i = 0; i < n_pages; i += 1) {
+        page  = addr + (i << system_info.log_2_page_size);
+        *page = 0;
+    }
+}
+
+/*
+ * Apply a heap's page attributes to a fresh block. Prefaulting is
+ * left to the heap since it goes through the page provider.
+ * These are all requests -- if the kernel says no, we log it and
+ * carry on with ordinary pages.
+ */
+internal void os_apply_page_attr(void *addr, u64 n_bytes, const hmalloc_heap_attr_t *attr) {
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long nodemask[OS_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    unsigned long bits_per_word;
+
+    /* Pages that are already there are moved. */
+    if (attr->numa_node >= 0 && attr->numa_node < OS_MAX_NUMA_NODES) {
+        bits_per_word = 8 * sizeof(unsigned long);
+
+        memset(nodemask, 0, sizeof(nodemask));
+        nodemask[attr->numa_node / bits_per_word] |= 1UL << (attr->numa_node % bits_per_word);
+
+        if (syscall(SYS_mbind, addr, n_bytes, MPOL_BIND, nodemask,
+                    OS_MAX_NUMA_NODES + 1, MPOL_MF_MOVE) != 0) {
+            LOG("mbind() to node %d failed for %p\n", attr->numa_node, addr);
+        }
+    }
+#endif
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+    if (attr->flags & HMALLOC_HEAP_HUGE_PAGES) {
+        madvise(addr, n_bytes, MADV_HUGEPAGE);
+    } else if (attr->flags & HMALLOC_HEAP_NO_HUGE_PAGES) {
+        madvise(addr, n_bytes, MADV_NOHUGEPAGE);
+    }
+#endif
+
+    /* This faults the pages in too. */
+    if (attr->flags & HMALLOC_HEAP_MLOCK) {
+        if (mlock(addr, n_bytes) != 0) {
+            LOG("mlock() failed for %p (%lu bytes) -- check RLIMIT_MEMLOCK\n", addr, n_bytes);
+        }
+    }
+}
+
+internal void * os_provider_alloc_pages(void *ctx, size_t n_bytes, size_t alignment) {
+    return get_pages_from_os(n_bytes >> system_info.log_2_page_size, alignment);
+}
+
+internal void os_provider_free_pages(void *ctx, void *addr, size_t n_bytes) {
+    release_pages_to_os(addr, n_bytes >> system_info.log_2_page_size);
+}
+
+internal int os_provider_purge(void *ctx, void *addr, size_t n_bytes) {
+    return madvise(addr, n_bytes, MADV_DONTNEED);
+}
+
+internal int os_provider_commit(void *ctx, void *addr, size_t n_bytes) {
+    prefault_pages(addr, n_bytes >> system_info.log_2_page_size);
+    return 0;
+}
+
+internal hmalloc_page_provider_t os_page_provider = {
+    .alloc_pages = os_provider_alloc_pages,
+    .free_pages  = os_provider_free_pages,
+    .purge       = os_provider_purge,
+    .commit      = os_provider_commit,
+    .ctx         = NULL,
+};
+
+internal int counting_provider_take_failure(hmalloc_counting_page_provider_t *counting) {
+    unsigned long n;
+
+    while ((n = counting->fail_next) > 0) {
+        if (__sync_bool_compare_and_swap(&counting->fail_next, n, n - 1)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+internal void * counting_provider_alloc_pages(void *ctx, size_t n_bytes, size_t alignment) {
+    hmalloc_counting_page_provider_t *counting;
+    unsigned long                     n_calls;
+
+    counting = ctx;
+    n_calls  = __sync_add_and_fetch(&counting->n_alloc_calls, 1);
+
+    if ((counting->fail_after && n_calls > counting->fail_after)
+    ||  counting_provider_take_failure(counting)) {
+        __sync_add_and_fetch(&counting->n_alloc_failures, 1);
+        return NULL;
+    }
+
+    return counting->backing->alloc_pages(counting->backing->ctx, n_bytes, alignment);
+}
+
+internal void counting_provider_free_pages(void *ctx, void *addr, size_t n_bytes) {
+    hmalloc_counting_page_provider_t *counting;
+
+    counting = ctx;
+    __sync_add_and_fetch(&counting->n_free_calls, 1);
+    counting->backing->free_pages(counting->backing->ctx, addr, n_bytes);
+}
+
+internal int counting_provider_purge(void *ctx, void *addr, size_t n_bytes) {
+    hmalloc_counting_page_provider_t *counting;
+
+    counting = ctx;
+    __sync_add_and_fetch(&counting->n_purge_calls, 1);
+    return counting->backing->purge(counting->backing->ctx, addr, n_bytes);
+}
+
+internal int counting_provider_commit(void *ctx, void *addr, size_t n_bytes) {
+    hmalloc_counting_page_provider_t *counting;
+
+    counting = ctx;
+    __sync_add_and_fetch(&counting->n_commit_calls, 1);
+    return counting->backing->commit(counting->backing->ctx, addr, n_bytes);
+}
+
+external hmalloc_page_provider_t * hmalloc_default_page_provider(void) {
+    return &os_page_provider;
+}
+
+external void hmalloc_set_default_page_provider(hmalloc_page_provider_t *provider) {
+    /*
+     * Only affects heaps that are created after this point.
+     * Existing heaps keep the provider their blocks came from.
+     */
+    default_page_provider = provider ? provider : &os_page_provider;
+}
+
+external void hmalloc_counting_page_provider_init(hmalloc_counting_page_provider_t *counting,
+                                                  hmalloc_page_provider_t *backing) {
+    memset(counting, 0, sizeof(*counting));
+
+    counting->provider.alloc_pages = counting_provider_alloc_pages;
+    counting->provider.free_pages  = counting_provider_free_pages;
+    counting->provider.purge       = counting_provider_purge;
+    counting->provider.commit      = counting_provider_commit;
+    counting->provider.ctx         = counting;
+    counting->backing              = backing ? backing : &os_page_provider;
+}
+
 __thread int thr_handle;
 
 internal pid_t os_get_tid(void) {
@@ -121,3 +309,36 @@ internal pid_t os_get_tid(void) {
 
     /* return tid; */
 }
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+/*
+ * glibc 2.35 and later register an rseq area for every thread and
+ * tell us where it is relative to the thread pointer. The kernel
+ * keeps cpu_id in it up to date, so reading it is just a load.
+ * Declared weak so that we still load against an older glibc.
+ */
+extern const ptrdiff_t    __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size   __attribute__((weak));
+
+#define OS_HAVE_RSEQ_CPU_ID
+#endif
+
+internal u32 os_get_cpu(void) {
+    int cpu;
+
+#ifdef OS_HAVE_RSEQ_CPU_ID
+    struct rseq *rs;
+
+    if (likely(&__rseq_size != NULL && __rseq_size != 0)) {
+        rs  = __builtin_thread_pointer() + __rseq_offset;
+        cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+
+        if (likely(cpu >= 0))    { return cpu; }
+    }
+#endif
+
+    /* No rseq. This goes through the vDSO where there is one. */
+    cpu = sched_getcpu();
+
+    return cpu >= 0 ? cpu : 0;
+}
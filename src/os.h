@@ -2,12 +2,14 @@
 #define __OS_H__
 
 #include "internal.h"
+#include "hmalloc.h"
 
 #include <sys/types.h>
 
 typedef struct {
     u64 page_size;
     u64 log_2_page_size;
+    u32 n_cpus;
 } system_info_t;
 
 internal system_info_t system_info;
@@ -16,6 +18,12 @@ internal void system_info_init(void);
 
 internal void * get_pages_from_os(u64 n_pages, u64 alignment);
 internal void   release_pages_to_os(void *addr, u64 n_pages);
+internal void   prefault_pages(void *addr, u64 n_pages);
+internal void   os_apply_page_attr(void *addr, u64 n_bytes, const hmalloc_heap_attr_t *attr);
 internal pid_t  os_get_tid(void);
+internal u32    os_get_cpu(void);
+
+internal hmalloc_page_provider_t  os_page_provider;
+internal hmalloc_page_provider_t *default_page_provider = &os_page_provider;
 
 #endif
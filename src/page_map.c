@@ -0,0 +1,130 @@
+#include "internal.h"
+#include "page_map.h"
+#include "os.h"
+
+internal void * page_map_new_node(void) {
+    u64 n_pages;
+
+    n_pages = MAX(1ULL, PAGE_MAP_NODE_SIZE >> system_info.log_2_page_size);
+
+    /* Zeroed by mmap(). */
+    return get_pages_from_os(n_pages, system_info.page_size);
+}
+
+internal void page_map_free_node(void *node) {
+    release_pages_to_os(node, MAX(1ULL, PAGE_MAP_NODE_SIZE >> system_info.log_2_page_size));
+}
+
+/*
+ * Find the node in *slot, or create it.
+ * If another thread beats us to creating it, use theirs.
+ * Returns NULL if the OS won't give us a new node.
+ */
+internal void * page_map_get_or_make_node(void **slot) {
+    void *node,
+         *new_node;
+
+    node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (likely(node != NULL))    { return node; }
+
+    new_node = page_map_new_node();
+
+    if (unlikely(new_node == NULL)) {
+        LOG("could not get memory for page map node\n");
+        return NULL;
+    }
+
+    if (__atomic_compare_exchange_n(slot, &node, new_node, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return new_node;
+    }
+
+    page_map_free_node(new_node);
+
+    return node;
+}
+
+/*
+ * Nodes are only made for non-NULL values. Clearing skips the parts
+ * of the range that have no nodes, since there's nothing there to
+ * clear.
+ * Returns 0, or -1 if a node couldn't be made, in which case only
+ * part of the range may have been set.
+ */
+internal int page_map_set_range(void *addr, u64 n_bytes, void *val) {
+    page_map_mid_t  *mid;
+    page_map_leaf_t *leaf;
+    u64              key,
+                     end_key;
+
+    ASSERT(PAGE_MAP_KEY(addr + n_bytes - 1) >> (3ULL * PAGE_MAP_LEVEL_BITS) == 0,
+           "address is outside of the page map");
+
+    key     = PAGE_MAP_KEY(addr);
+    end_key = PAGE_MAP_KEY(addr + n_bytes - 1) + 1;
+
+    while (key < end_key) {
+        if (val == NULL) {
+            mid = __atomic_load_n(&page_map_root[PAGE_MAP_ROOT_IDX(key)], __ATOMIC_ACQUIRE);
+            if (mid == NULL) {
+                key = (PAGE_MAP_ROOT_IDX(key) + 1ULL) << (2ULL * PAGE_MAP_LEVEL_BITS);
+                continue;
+            }
+
+            leaf = (page_map_leaf_t*)__atomic_load_n(&(*mid)[PAGE_MAP_MID_IDX(key)], __ATOMIC_ACQUIRE);
+            if (leaf == NULL) {
+                key = ((key >> PAGE_MAP_LEVEL_BITS) + 1ULL) << PAGE_MAP_LEVEL_BITS;
+                continue;
+            }
+        } else {
+            mid = page_map_get_or_make_node((void**)&page_map_root[PAGE_MAP_ROOT_IDX(key)]);
+            if (unlikely(mid == NULL))     { return -1; }
+
+            leaf = page_map_get_or_make_node((void**)&(*mid)[PAGE_MAP_MID_IDX(key)]);
+            if (unlikely(leaf == NULL))    { return -1; }
+        }
+
+        /* Fill to the end of this leaf or the range, whichever is first. */
+        do {
+            __atomic_store_n(&(*leaf)[PAGE_MAP_LEAF_IDX(key)], val, __ATOMIC_RELEASE);
+            key += 1;
+        } while (key < end_key && PAGE_MAP_LEAF_IDX(key) != 0);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 0, or -1 if the page map couldn't grow to cover the range.
+ * Nothing in the range is left pointing at the block on failure.
+ */
+internal int page_map_set(void *addr, u64 n_bytes, void *block) {
+    if (unlikely(page_map_set_range(addr, n_bytes, block) != 0)) {
+        page_map_clear(addr, n_bytes);
+        return -1;
+    }
+
+    return 0;
+}
+
+internal void page_map_clear(void *addr, u64 n_bytes) {
+    page_map_set_range(addr, n_bytes, NULL);
+}
+
+internal void * page_map_lookup(void *addr) {
+    page_map_mid_t  *mid;
+    void           **leaf;
+    u64              key;
+
+    key = PAGE_MAP_KEY(addr);
+
+    if (unlikely(key >> (3ULL * PAGE_MAP_LEVEL_BITS)))    { return NULL; }
+
+    mid = __atomic_load_n(&page_map_root[PAGE_MAP_ROOT_IDX(key)], __ATOMIC_ACQUIRE);
+    if (unlikely(mid == NULL))                            { return NULL; }
+
+    leaf = __atomic_load_n(&(*mid)[PAGE_MAP_MID_IDX(key)], __ATOMIC_ACQUIRE);
+    if (unlikely(leaf == NULL))                           { return NULL; }
+
+    return __atomic_load_n(&leaf[PAGE_MAP_LEAF_IDX(key)], __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,44 @@
+#ifndef __PAGE_MAP_H__
+#define __PAGE_MAP_H__
+
+#include "internal.h"
+
+/*
+ * The page map takes any address to the header of the block that
+ * contains it (or NULL if hmalloc doesn't own it).
+ *
+ * It is a three level radix tree over 4 KiB page numbers of a
+ * 48-bit address space. Interior and leaf nodes are created on
+ * demand and never freed, so lookups don't need any locks.
+ * Entries for a block are written when the block is handed to a
+ * heap and cleared before it is given back to its provider. If a
+ * node can't be made, the block is given back and the allocation
+ * fails.
+ */
+
+#define PAGE_MAP_PAGE_SHIFT  (12ULL)
+#define PAGE_MAP_ADDR_BITS   (48ULL)
+#define PAGE_MAP_LEVEL_BITS  (12ULL)
+#define PAGE_MAP_NODE_LEN    (1ULL << PAGE_MAP_LEVEL_BITS)
+#define PAGE_MAP_NODE_MASK   (PAGE_MAP_NODE_LEN - 1ULL)
+#define PAGE_MAP_NODE_SIZE   (PAGE_MAP_NODE_LEN * sizeof(void*))
+
+#if (PAGE_MAP_ADDR_BITS - PAGE_MAP_PAGE_SHIFT) != (3 * PAGE_MAP_LEVEL_BITS)
+    #error "page map levels don't cover the address space"
+#endif
+
+#define PAGE_MAP_KEY(addr)     (((u64)(void*)(addr)) >> PAGE_MAP_PAGE_SHIFT)
+#define PAGE_MAP_ROOT_IDX(key) ((key) >> (2ULL * PAGE_MAP_LEVEL_BITS))
+#define PAGE_MAP_MID_IDX(key)  (((key) >> PAGE_MAP_LEVEL_BITS) & PAGE_MAP_NODE_MASK)
+#define PAGE_MAP_LEAF_IDX(key) ((key) & PAGE_MAP_NODE_MASK)
+
+typedef void  *page_map_leaf_t[PAGE_MAP_NODE_LEN];
+typedef void **page_map_mid_t[PAGE_MAP_NODE_LEN];
+
+internal page_map_mid_t *page_map_root[PAGE_MAP_NODE_LEN];
+
+internal int    page_map_set(void *addr, u64 n_bytes, void *block);
+internal void   page_map_clear(void *addr, u64 n_bytes);
+internal void * page_map_lookup(void *addr);
+
+#endif
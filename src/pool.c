@@ -0,0 +1,299 @@
+#include "internal.h"
+#include "pool.h"
+#include "thread.h"
+#include "page_map.h"
+
+#include <string.h>
+
+internal u64 pool_data_offset(u64 n_slots, u64 alignment) {
+    return ALIGN(sizeof(block_header_t) + 2 * sizeof(u64) * ((n_slots + 63) / 64), alignment);
+}
+
+internal pool_t * pool_new(const char *name, u64 obj_size, u64 alignment,
+                           void (*ctor)(void*), void (*dtor)(void*)) {
+    pool_t *pool;
+    u64     stride,
+            n_slots,
+            len;
+
+    if (alignment == 0) {
+        alignment = 8;
+    }
+
+    if (obj_size == 0
+    ||  obj_size > POOL_MAX_OBJ_SIZE
+    ||  !IS_POWER_OF_TWO(alignment)
+    ||  alignment > system_info.page_size) {
+        return NULL;
+    }
+
+    alignment = MAX(alignment, 8);
+    stride    = ALIGN(obj_size, alignment);
+
+    /*
+     * Each slot also takes two bits of bitmap. Start from the
+     * estimate and back off until the bitmaps and padding fit too.
+     */
+    n_slots = ((DEFAULT_BLOCK_SIZE - sizeof(block_header_t)) * 4) / (stride * 4 + 1);
+
+    while (pool_data_offset(n_slots, alignment) + n_slots * stride > DEFAULT_BLOCK_SIZE) {
+        n_slots -= 1;
+    }
+
+    if (name == NULL) {
+        name = "";
+    }
+
+    len  = strlen(name);
+    pool = icalloc(1, sizeof(pool_t) + len + 1);
+
+    if (unlikely(pool == NULL))    { return NULL; }
+
+    memcpy(pool->name_buff, name, len + 1);
+
+    pool->obj_size    = obj_size;
+    pool->stride      = stride;
+    pool->n_slots     = n_slots;
+    pool->n_words     = (n_slots + 63) / 64;
+    pool->data_offset = pool_data_offset(n_slots, alignment);
+    pool->ctor        = ctor;
+    pool->dtor        = dtor;
+    pool->partial     = NULL;
+    pool->full        = NULL;
+    pool->n_empty     = 0;
+
+    heap_make(&pool->heap);
+    pool->heap.__meta.handle = pool->name_buff;
+    pool->heap.__meta.flags |= HEAP_POOL;
+
+    LOG("hid %d is a pool (name = '%s', obj_size = %lu, stride = %lu, %lu slots per block)\n",
+        pool->heap.__meta.hid, pool->name_buff, obj_size, stride, n_slots);
+
+    return pool;
+}
+
+internal void pblock_push(pblock_header_t **list, pblock_header_t *pblock) {
+    pblock->prev = NULL;
+    pblock->next = *list;
+
+    if (*list != NULL) {
+        (*list)->prev = pblock;
+    }
+
+    *list = pblock;
+}
+
+internal void pblock_unlink(pblock_header_t **list, pblock_header_t *pblock) {
+    if (pblock->prev != NULL) {
+        pblock->prev->next = pblock->next;
+    } else {
+        *list = pblock->next;
+    }
+
+    if (pblock->next != NULL) {
+        pblock->next->prev = pblock->prev;
+    }
+}
+
+/* Called with the pool locked. */
+internal pblock_header_t * pool_new_pblock(pool_t *pool) {
+    block_header_t  *block;
+    pblock_header_t *pblock;
+    u64             *taken;
+
+    block = heap_get_block_pages(&pool->heap, DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size);
+
+    if (unlikely(block == NULL))    { return NULL; }
+
+    block->heap__meta = pool->heap.__meta;
+    block->heap       = &pool->heap;
+    block->provider   = pool->heap.provider;
+    block->tid        = get_this_tid();
+    block->block_kind = BLOCK_KIND_PBLOCK;
+    pblock            = &(block->p);
+    pblock->end       = ((void*)block) + DEFAULT_BLOCK_SIZE;
+    pblock->n_taken   = 0;
+    pblock->next_word = 0;
+
+    /*
+     * The bitmaps are zeroed by the provider. Mark the bits past
+     * the last slot as taken so that searches never stop on them.
+     */
+    taken = PBLOCK_TAKEN(pool, pblock);
+
+    if (pool->n_slots % 64) {
+        taken[pool->n_words - 1] = ~((1ULL << (pool->n_slots % 64)) - 1ULL);
+    }
+
+    if (unlikely(page_map_set(block, DEFAULT_BLOCK_SIZE, block) != 0)) {
+        pool->heap.provider->free_pages(pool->heap.provider->ctx, block, DEFAULT_BLOCK_SIZE);
+        return NULL;
+    }
+
+    pblock_push(&pool->partial, pblock);
+    pool->n_empty += 1;
+
+    return pblock;
+}
+
+/*
+ * Called without the pool locked, once the block is off the pool's
+ * lists.
+ */
+internal void pool_release_pblock(pool_t *pool, pblock_header_t *pblock) {
+    hmalloc_page_provider_t *provider;
+    u64                     *constructed,
+                             word,
+                             w;
+
+    if (pool->dtor != NULL) {
+        constructed = PBLOCK_CONSTRUCTED(pool, pblock);
+
+        for (w = 0; w < pool->n_words; w += 1) {
+            for (word = constructed[w]; word != 0; word &= word - 1) {
+                pool->dtor(PBLOCK_SLOT(pool, pblock, w * 64 + __builtin_ctzll(word)));
+            }
+        }
+    }
+
+    provider = ((block_header_t*)pblock)->provider;
+
+    page_map_clear(pblock, pblock->end - (void*)pblock);
+    provider->free_pages(provider->ctx, pblock, pblock->end - (void*)pblock);
+}
+
+internal void * pool_alloc(pool_t *pool) {
+    heap_t          *heap;
+    pblock_header_t *pblock;
+    u64             *taken,
+                    *constructed,
+                     bit;
+    u32              w;
+    int              was_constructed;
+    void            *addr;
+
+    heap = &pool->heap;
+
+    HEAP_LOCK(heap);
+
+    pblock = pool->partial;
+
+    if (pblock == NULL && (pblock = pool_new_pblock(pool)) == NULL) {
+        release_heap(heap);
+        return NULL;
+    }
+
+    taken = PBLOCK_TAKEN(pool, pblock);
+
+    for (w = pblock->next_word; taken[w] == ALL_SLOTS_TAKEN; w += 1);
+
+    ASSERT(w < pool->n_words, "partial pblock has no free slots");
+
+    bit               = 1ULL << __builtin_ctzll(~taken[w]);
+    taken[w]         |= bit;
+    pblock->next_word = w;
+
+    if (pblock->n_taken++ == 0) {
+        pool->n_empty -= 1;
+    }
+
+    if (pblock->n_taken == pool->n_slots) {
+        pblock_unlink(&pool->partial, pblock);
+        pblock_push(&pool->full, pblock);
+    }
+
+    constructed      = PBLOCK_CONSTRUCTED(pool, pblock);
+    was_constructed  = !!(constructed[w] & bit);
+    constructed[w]  |= bit;
+    addr             = PBLOCK_SLOT(pool, pblock, w * 64 + __builtin_ctzll(bit));
+
+    release_heap(heap);
+
+    /* The slot is ours now, so nobody else can see it half built. */
+    if (!was_constructed && pool->ctor != NULL) {
+        pool->ctor(addr);
+    }
+
+    return addr;
+}
+
+internal void pool_free(pool_t *pool, block_header_t *block, void *addr) {
+    heap_t          *heap;
+    pblock_header_t *pblock,
+                    *release;
+    u64             *taken,
+                     slot,
+                     bit;
+    u32              w;
+
+    heap   = &pool->heap;
+    pblock = &(block->p);
+    slot   = (addr - (void*)block - pool->data_offset) / pool->stride;
+    w      = slot / 64;
+    bit    = 1ULL << (slot % 64);
+
+    ASSERT(addr == PBLOCK_SLOT(pool, pblock, slot), "freeing a pointer into the middle of a pool object");
+
+    release = NULL;
+
+    HEAP_LOCK(heap);
+
+    taken = PBLOCK_TAKEN(pool, pblock);
+
+    ASSERT(taken[w] & bit, "double free of a pool object");
+
+    taken[w] &= ~bit;
+
+    if (w < pblock->next_word) {
+        pblock->next_word = w;
+    }
+
+    if (pblock->n_taken-- == pool->n_slots) {
+        pblock_unlink(&pool->full, pblock);
+        pblock_push(&pool->partial, pblock);
+    }
+
+    if (pblock->n_taken == 0) {
+        if (pool->n_empty > 0) {
+            pblock_unlink(&pool->partial, pblock);
+            release = pblock;
+        } else {
+            pool->n_empty += 1;
+        }
+    }
+
+    release_heap(heap);
+
+    if (release != NULL) {
+        pool_release_pblock(pool, release);
+    }
+}
+
+/* Nothing may be using the pool. */
+internal void pool_destroy(pool_t *pool) {
+    pblock_header_t         *pblock,
+                            *next;
+    hmalloc_page_provider_t *provider;
+    void                    *spare;
+
+    for (pblock = pool->partial; pblock != NULL; pblock = next) {
+        next = pblock->next;
+        pool_release_pblock(pool, pblock);
+    }
+
+    for (pblock = pool->full; pblock != NULL; pblock = next) {
+        next = pblock->next;
+        pool_release_pblock(pool, pblock);
+    }
+
+    spare = __atomic_exchange_n(&pool->heap.spare_block, NULL, __ATOMIC_ACQUIRE);
+
+    if (spare != NULL) {
+        provider = pool->heap.provider;
+        provider->free_pages(provider->ctx, spare, DEFAULT_BLOCK_SIZE);
+    }
+
+    LOG("destroyed pool '%s' (hid = %d)\n", pool->name_buff, pool->heap.__meta.hid);
+
+    ifree(pool);
+}
@@ -0,0 +1,58 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "internal.h"
+#include "heap.h"
+
+/*
+ * Object pools (slab caches).
+ *
+ * A pool hands out objects of one size from blocks that are cut
+ * into slots of exactly that size (rounded up to the alignment), so
+ * there is no rounding to a size class and no per-object header.
+ *
+ * Objects are constructed once. The first time that a slot is handed
+ * out, the pool's constructor is run on it and the slot is marked as
+ * constructed. Freeing an object leaves it as it is, so it has to be
+ * put back into its constructed state first, and the next allocation
+ * of that slot skips the constructor. The destructor is only run when
+ * a block goes back to its page provider or the pool is destroyed.
+ * The constructor and destructor run without the pool's lock held.
+ *
+ * Blocks with free slots are kept on partial, and the rest on full.
+ * One completely free block is kept (with its constructed objects)
+ * for when the pool grows again. Any other block that becomes free is
+ * released.
+ *
+ * Pool blocks are marked with HEAP_POOL so that hmalloc_free() sends
+ * objects back to their pool. The pool is always locked.
+ */
+
+#define POOL_MAX_OBJ_SIZE (DEFAULT_BLOCK_SIZE / 16)
+
+typedef struct pool {
+    heap_t            heap;
+    u64               obj_size;
+    u64               stride;
+    u64               n_slots;
+    u64               n_words;
+    u64               data_offset;
+    void            (*ctor)(void*);
+    void            (*dtor)(void*);
+    pblock_header_t  *partial;
+    pblock_header_t  *full;
+    u32               n_empty;
+    char              name_buff[];
+} pool_t;
+
+#define PBLOCK_TAKEN(pool, pblock)       ((u64*)(((void*)(pblock)) + sizeof(block_header_t)))
+#define PBLOCK_CONSTRUCTED(pool, pblock) (PBLOCK_TAKEN((pool), (pblock)) + (pool)->n_words)
+#define PBLOCK_SLOT(pool, pblock, i)     (((void*)(pblock)) + (pool)->data_offset + ((i) * (pool)->stride))
+
+internal pool_t * pool_new(const char *name, u64 obj_size, u64 alignment,
+                           void (*ctor)(void*), void (*dtor)(void*));
+internal void * pool_alloc(pool_t *pool);
+internal void pool_free(pool_t *pool, block_header_t *block, void *addr);
+internal void pool_destroy(pool_t *pool);
+
+#endif
@@ -0,0 +1,145 @@
+#include "internal.h"
+#include "prefetch.h"
+#include "os.h"
+#include "heap.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+internal void * prefetch_fn(void *arg) {
+    struct timespec backoff;
+    void           *block;
+    u64             n_pages;
+
+    LOG("(prefetch) prefetch_fn started\n");
+
+    n_pages         = DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size;
+    backoff.tv_sec  = 0;
+    backoff.tv_nsec = 1000000;
+
+    for (;;) {
+        PREFETCH_LOCK(); {
+            while (prefetch_data.n_ready >= prefetch_data.target) {
+                pthread_cond_wait(&prefetch_data.cond, &prefetch_data.mtx);
+            }
+        } PREFETCH_UNLOCK();
+
+        block = get_pages_from_os(n_pages, BLOCK_ALIGNMENT);
+
+        if (unlikely(block == NULL)) {
+            /*
+             * The system is out of memory for now.
+             * Allocating threads will fall back to asking the OS
+             * themselves, so just wait a bit before trying again.
+             */
+            nanosleep(&backoff, NULL);
+            continue;
+        }
+
+        prefault_pages(block, n_pages);
+
+        /*
+         * We are the only producer, so there is always room
+         * for the block here.
+         */
+        PREFETCH_LOCK(); {
+            ASSERT(prefetch_data.n_ready < prefetch_data.target, "prefetch pool overflow");
+            prefetch_data.ready[prefetch_data.n_ready] = block;
+            prefetch_data.n_ready += 1;
+        } PREFETCH_UNLOCK();
+    }
+
+    return NULL;
+}
+
+/*
+ * The caller has already set prefetch_data.running, so nobody else
+ * starts one too. Called without the lock: pthread_create() can
+ * allocate, and that can come back through prefetch_take_block().
+ */
+internal void prefetch_start_thread(void) {
+    int err;
+
+    err = pthread_create(&prefetch_data.thread_id, NULL, prefetch_fn, NULL);
+
+    if (err != 0) {
+        LOG("(prefetch) could not create prefetch thread -- disabling prefetching\n");
+        prefetch_data.target = 0;
+    }
+}
+
+internal void prefetch_atfork_prepare(void) { PREFETCH_LOCK();   }
+internal void prefetch_atfork_parent(void)  { PREFETCH_UNLOCK(); }
+
+internal void prefetch_atfork_child(void) {
+    /*
+     * The prefetch thread doesn't exist in the child.
+     * Start from fresh synchronization state. Creating a thread
+     * isn't safe here, and most children exec() right away, so the
+     * child's producer is started by its first prefetch_take_block().
+     * The blocks that are already in the pool were inherited along
+     * with the rest of the address space.
+     */
+    pthread_mutex_init(&prefetch_data.mtx, NULL);
+    pthread_cond_init(&prefetch_data.cond, NULL);
+
+    prefetch_data.running = 0;
+}
+
+internal void prefetch_init(void) {
+    const char *n_blocks_str;
+    long        n_blocks;
+
+    n_blocks_str = getenv("HMALLOC_PREFETCH_BLOCKS");
+
+    if (n_blocks_str == NULL)    { return; }
+
+    n_blocks = strtol(n_blocks_str, NULL, 10);
+
+    if (n_blocks <= 0)           { return; }
+
+    if (n_blocks > HMALLOC_PREFETCH_MAX_BLOCKS) {
+        LOG("(prefetch) HMALLOC_PREFETCH_BLOCKS = %ld is too large -- using %d\n",
+            n_blocks, HMALLOC_PREFETCH_MAX_BLOCKS);
+        n_blocks = HMALLOC_PREFETCH_MAX_BLOCKS;
+    }
+
+    prefetch_data.target = n_blocks;
+
+    pthread_atfork(prefetch_atfork_prepare, prefetch_atfork_parent, prefetch_atfork_child);
+
+    prefetch_data.running = 1;
+    prefetch_start_thread();
+
+    LOG("initialized block prefetcher (%u blocks)\n", prefetch_data.target);
+}
+
+internal void * prefetch_take_block(void) {
+    void *block;
+    int   start;
+
+    if (prefetch_data.target == 0)    { return NULL; }
+
+    block = NULL;
+    start = 0;
+
+    PREFETCH_LOCK(); {
+        /* A forked child starts its producer on first use. */
+        if (unlikely(!prefetch_data.running)) {
+            prefetch_data.running = 1;
+            start                 = 1;
+        }
+
+        if (prefetch_data.n_ready > 0) {
+            prefetch_data.n_ready -= 1;
+            block                  = prefetch_data.ready[prefetch_data.n_ready];
+        }
+
+        /* Wake the producer so that it replaces what we took. */
+        pthread_cond_signal(&prefetch_data.cond);
+    } PREFETCH_UNLOCK();
+
+    if (unlikely(start))    { prefetch_start_thread(); }
+
+    return block;
+}
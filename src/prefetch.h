@@ -0,0 +1,43 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "internal.h"
+
+#include <pthread.h>
+
+/*
+ * The prefetcher keeps a small set of DEFAULT_BLOCK_SIZE blocks
+ * mapped and prefaulted by a background thread so that
+ * heap_new_sblock() and heap_new_cblock() don't have to pay for
+ * mmap() and the page faults of a fresh block on the allocating
+ * thread.
+ *
+ * It is off unless HMALLOC_PREFETCH_BLOCKS=<n> is set.
+ * A forked child doesn't get a producer until it first takes a
+ * block, so children that just exec() never start one.
+ */
+
+#define HMALLOC_PREFETCH_MAX_BLOCKS (64)
+
+typedef struct {
+    void            *ready[HMALLOC_PREFETCH_MAX_BLOCKS];
+    u32              n_ready;
+    u32              target;
+    pthread_mutex_t  mtx;
+    pthread_cond_t   cond;
+    pthread_t        thread_id;
+    int              running;
+} prefetch_data_t;
+
+internal prefetch_data_t prefetch_data = {
+    .mtx  = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+#define PREFETCH_LOCK()   HMALLOC_MTX_LOCKER(&prefetch_data.mtx)
+#define PREFETCH_UNLOCK() HMALLOC_MTX_UNLOCKER(&prefetch_data.mtx)
+
+internal void   prefetch_init(void);
+internal void * prefetch_take_block(void);
+
+#endif
@@ -166,19 +166,19 @@ internal void profile_get_w_accesses_for_cpu(int cpu, profile_info *profs) {
 
         addr  = (void *) (sample->addr);
         block = ADDR_PARENT_BLOCK(addr);
-        tid   = OS_TID_TO_HM_TID(sample->tid);
+
+        /* Not memory from one of our blocks. */
+        if (block == NULL)    { goto inc; }
+
+        tid = block->tid;
 
         /*
          * As an optimization, let's do the first lookup in the thread
-         * that the sample occurred in.
-         * The chances are high that many accesses to data will occur in
-         * the thread that allocated it.
-         *
-         * Of course, this is not always the case, but it doesn't hurt to
-         * check the sample thread first.
+         * that allocated the block. Objects are filed under that
+         * thread, so this should almost always hit.
          */
         PROF_THREAD_LOCK(tid); {
-            thr = &prof_data.thread_objects[tid];
+            thr = prof_thread_objects_for_tid(tid);
 
             if (thr->is_initialized) {
                 if ((m_obj = hash_table_get_val(thr->blocks, block))) {
@@ -236,7 +236,7 @@ found:
             }
         }
 
-        obj->shared |= (tid != obj->tid);
+        obj->shared |= ((i32)sample->tid != obj->os_tid);
 
         tsc_diff = tsc - obj->m_ns;
 
@@ -309,19 +309,19 @@ internal void profile_get_r_accesses_for_cpu(int cpu, profile_info *profs) {
 
         addr  = (void *) (sample->addr);
         block = ADDR_PARENT_BLOCK(addr);
-        tid   = OS_TID_TO_HM_TID(sample->tid);
+
+        /* Not memory from one of our blocks. */
+        if (block == NULL)    { goto inc; }
+
+        tid = block->tid;
 
         /*
          * As an optimization, let's do the first lookup in the thread
-         * that the sample occurred in.
-         * The chances are high that many accesses to data will occur in
-         * the thread that allocated it.
-         *
-         * Of course, this is not always the case, but it doesn't hurt to
-         * check the sample thread first.
+         * that allocated the block. Objects are filed under that
+         * thread, so this should almost always hit.
          */
         PROF_THREAD_LOCK(tid); {
-            thr = &prof_data.thread_objects[tid];
+            thr = prof_thread_objects_for_tid(tid);
 
             if (thr->is_initialized) {
                 if ((m_obj = hash_table_get_val(thr->blocks, block))) {
@@ -379,7 +379,7 @@ found:
             }
         }
 
-        obj->shared |= (tid != obj->tid);
+        obj->shared |= ((i32)sample->tid != obj->os_tid);
 
         tsc_diff = tsc - obj->m_ns;
 
@@ -454,13 +454,12 @@ internal void profile_get_accesses(void) {
 
 void* profile_fn(void *arg) {
     struct timespec timer;
-    thread_data_t *thr;
 
 
     LOG("(profile) profile_fn started\n");
-    thr = acquire_this_thread();
-    LOG("(profile) profiling thread has tid %d\n", thr->tid);
-    release_thread(thr);
+    /* Give the profiling thread its slot now. */
+    get_this_thread();
+    LOG("(profile) profiling thread has tid %d\n", get_this_tid());
 
     const uint64_t one_sec_in_ns = 1000000000;
     timer.tv_sec  = (uint64_t)profile_rate;
@@ -563,7 +562,7 @@ internal void profile_init_events(profile_info *profs, char *event) {
         } else {
             profs[n_profs].fd = fd;
 
-            LOG("(profile) perf event '%s' opened from tid %d (os %d) for cpu %d\n", event, get_this_tid(), os_get_tid(), n_profs);
+            LOG("(profile) perf event '%s' opened from os tid %d for cpu %d\n", event, os_get_tid(), n_profs);
             LOG("(profile) fd for cpu %d is %d\n", n_profs, profs[n_profs].fd);
 
             /* mmap the file */
@@ -600,7 +599,7 @@ internal void profile_init(void) {
 
     pthread_mutex_lock(&access_profile_flush_signal_mutex);
 
-    prof_data.tid = get_this_tid();
+    prof_data.tid = os_get_tid();
     prof_data.pid = getpid();
 
     prof_data.pagesize = (size_t) sysconf(_SC_PAGESIZE);
@@ -619,7 +618,18 @@ internal void profile_init(void) {
     hmalloc_use_imalloc = 0;
 }
 
-internal void profile_thr_init(prof_thread_objects *thr, u16 tid) {
+internal prof_thread_objects * prof_thread_objects_for_tid(u32 tid) {
+    prof_thread_objects *segment;
+    u64                  seg;
+
+    seg     = THREAD_SEGMENT(tid);
+    segment = get_or_make_segment((void**)&prof_data.thread_objects[seg],
+                                  THREAD_SEGMENT_LEN(seg) * sizeof(prof_thread_objects));
+
+    return segment + THREAD_SEGMENT_IDX(tid);
+}
+
+internal void profile_thr_init(prof_thread_objects *thr, u32 tid) {
     ASSERT(!thr->is_initialized, "profile thread data is already initialized!");
 
     thr->blocks = hash_table_make(block_addr_t, profile_obj_entry_ptr, block_addr_hash);
@@ -632,8 +642,7 @@ internal void profile_thr_init(prof_thread_objects *thr, u16 tid) {
 internal void profile_add_block(void *block, u64 size) {
     heap__meta_t        *__meta;
     block_header_t      *b;
-    void                *block_aligned_addr;
-    u16                  tid;
+    u32                  tid;
     profile_obj_entry   *obj;
     prof_thread_objects *thr;
 
@@ -655,29 +664,25 @@ internal void profile_add_block(void *block, u64 size) {
     obj->size        = size;
     obj->heap_handle = __meta->flags & HEAP_USER ? __meta->handle : NULL;
     obj->tid         = b->tid;
+    obj->os_tid      = get_this_thread()->os_tid;
     obj->m_ns        = gettime_ns();
 
 PROF_THREAD_LOCK(tid); {
-    thr = &prof_data.thread_objects[tid];
+    thr = prof_thread_objects_for_tid(tid);
 
     if (!thr->is_initialized) {
         profile_thr_init(thr, tid);
     }
 
-    block_aligned_addr = block;
-    while (block_aligned_addr < (&(b->c))->end) {
-        hash_table_insert(thr->blocks, block_aligned_addr, obj);
-        block_aligned_addr += DEFAULT_BLOCK_SIZE;
-    }
+    hash_table_insert(thr->blocks, block, obj);
 
 } PROF_THREAD_UNLOCK(tid);
 }
 
 internal void profile_delete_block(void *block) {
     block_header_t      *b;
-    void                *block_aligned_addr;
     profile_obj_entry  **m_obj, *obj;
-    u16                  tid;
+    u32                  tid;
     prof_thread_objects *thr;
 
     ASSERT(doing_profiling, "can't delete block when not profiling");
@@ -690,7 +695,7 @@ internal void profile_delete_block(void *block) {
     tid = b->tid;
 
 PROF_THREAD_LOCK(tid); {
-    thr = &prof_data.thread_objects[tid];
+    thr = prof_thread_objects_for_tid(tid);
 
     ASSERT(thr->is_initialized,
            "attempting to delete a block from a profile thread data"
@@ -700,11 +705,7 @@ PROF_THREAD_LOCK(tid); {
     ASSERT(m_obj, "object info not found for block");
     obj   = *m_obj;
 
-    block_aligned_addr = block;
-    while (block_aligned_addr < (&(b->c))->end) {
-        hash_table_delete(thr->blocks, block_aligned_addr);
-        block_aligned_addr += DEFAULT_BLOCK_SIZE;
-    }
+    hash_table_delete(thr->blocks, block);
 
     if (obj) {
         obj->f_ns = gettime_ns();
@@ -719,15 +720,18 @@ internal void profile_set_site(void *addr, char *site) {
     void                *block_addr;
     block_header_t      *block;
     profile_obj_entry  **m_obj, *obj;
-    u16                  tid;
+    u32                  tid;
     prof_thread_objects *thr;
 
     block_addr = ADDR_PARENT_BLOCK(addr);
     block      = block_addr;
+
+    ASSERT(block, "setting site for memory that isn't in a block");
+
     tid        = block->tid;
 
 PROF_THREAD_LOCK(tid); {
-    thr = &prof_data.thread_objects[tid];
+    thr = prof_thread_objects_for_tid(tid);
 
     ASSERT(thr->is_initialized,
            "attempting to set site for a block from a profile thread data"
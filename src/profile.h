@@ -15,7 +15,7 @@ internal i32 doing_profiling;
 
 typedef void *block_addr_t;
 static inline u64 block_addr_hash(void *b) {
-    return ((u64)b) >> LOG2_64BIT(DEFAULT_BLOCK_SIZE);
+    return ((u64)b) >> PAGE_MAP_PAGE_SHIFT;
 }
 
 internal u64 bucket_max_values[] = {
@@ -38,6 +38,7 @@ typedef struct {
     u64    size;
     char  *heap_handle;
     i32    tid;
+    i32    os_tid;
     i32    shared;
     u64    m_ns;
     u64    f_ns;
@@ -54,17 +55,23 @@ use_hash_table(block_addr_t, profile_obj_entry_ptr);
 #undef malloc
 #undef free
 
+/*
+ * Indexed by hmalloc thread id and stored in segments the same way
+ * as thread_data_t. The mutex is usable as soon as its segment is
+ * mapped since PTHREAD_MUTEX_INITIALIZER is all zeros.
+ */
 typedef struct {
     hash_table(block_addr_t, profile_obj_entry_ptr) blocks;
     int                                             is_initialized;
-    u16                                             tid;
+    u32                                             tid;
+    pthread_mutex_t                                 mtx;
 } prof_thread_objects;
 
 typedef struct {
     i32                 thread_started;
     i32                 should_stop;
     u32                 nom_freq;
-    prof_thread_objects thread_objects[HMALLOC_MAX_THREADS];
+    prof_thread_objects *thread_objects[THREAD_N_SEGMENTS];
     array_t             obj_buff;
     int                 fd;
     i32                 tid;
@@ -77,13 +84,10 @@ typedef struct {
 
 internal profile_data prof_data;
 
-pthread_mutex_t prof_thread_mutices[HMALLOC_MAX_THREADS]
-    = { [0 ... (HMALLOC_MAX_THREADS - 1)] = PTHREAD_MUTEX_INITIALIZER };
-
 pthread_mutex_t access_profile_flush_mutex        = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t access_profile_flush_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define PROF_THREAD_LOCK(tid)   HMALLOC_MTX_LOCKER(&prof_thread_mutices[(tid)])
-#define PROF_THREAD_UNLOCK(tid) HMALLOC_MTX_UNLOCKER(&prof_thread_mutices[(tid)])
+#define PROF_THREAD_LOCK(tid)   HMALLOC_MTX_LOCKER(&prof_thread_objects_for_tid((tid))->mtx)
+#define PROF_THREAD_UNLOCK(tid) HMALLOC_MTX_UNLOCKER(&prof_thread_objects_for_tid((tid))->mtx)
 #define OBJ_BUFF_LOCK()         HMALLOC_MTX_LOCKER(&prof_data.obj_buff_mtx)
 #define OBJ_BUFF_UNLOCK()       HMALLOC_MTX_UNLOCKER(&prof_data.obj_buff_mtx)
 
@@ -91,13 +95,13 @@ pthread_mutex_t access_profile_flush_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
  * If you use 'break' in one of these loops without unlocking first,
  * you will be sad.
  */
-#define LOCKING_THREAD_TRAVERSE(thr_ptr)                            \
-    for (int _thr_it = 0;                                           \
-        (_thr_it < HMALLOC_MAX_THREADS)                             \
-            && ((thr_ptr = prof_data.thread_objects + _thr_it),     \
-                (pthread_mutex_lock(prof_thread_mutices + _thr_it)), \
-                1);                                                 \
-         pthread_mutex_unlock(prof_thread_mutices + _thr_it),       \
+#define LOCKING_THREAD_TRAVERSE(thr_ptr)                                      \
+    for (u32 _thr_it = 0;                                                     \
+        (_thr_it < __atomic_load_n(&thread_registry.n_slots, __ATOMIC_ACQUIRE)) \
+            && ((thr_ptr = prof_thread_objects_for_tid(_thr_it)),             \
+                (pthread_mutex_lock(&thr_ptr->mtx)),                          \
+                1);                                                           \
+         pthread_mutex_unlock(&thr_ptr->mtx),                                 \
          _thr_it += 1)
 
 struct __attribute__ ((__packed__)) sample {
@@ -122,6 +126,8 @@ typedef struct {
 
 
 
+internal prof_thread_objects * prof_thread_objects_for_tid(u32 tid);
+
 internal void profile_init(void);
 internal void profile_fini(void);
 internal void profile_add_block(void *block, u64 size);
@@ -0,0 +1,143 @@
+#include "internal.h"
+#include "shared_heap.h"
+#include "thread.h"
+#include "os.h"
+
+#include <stdlib.h>
+
+internal void shared_heaps_init(void) {
+    const char *arenas_str;
+    heap_t     *heap;
+    u64         n_pages;
+    long        n_arenas;
+    u32         mode,
+                i;
+
+    arenas_str = getenv("HMALLOC_ARENAS");
+
+    if (arenas_str != NULL) {
+        mode     = SHARED_HEAPS_ARENAS;
+        n_arenas = strtol(arenas_str, NULL, 10);
+
+        if (n_arenas <= 0) {
+            n_arenas = SHARED_HEAP_ARENAS_PER_CPU * system_info.n_cpus;
+        }
+
+        shared_heaps.n_heaps = n_arenas;
+    } else if (getenv("HMALLOC_PERCPU_HEAPS") != NULL) {
+        mode                 = SHARED_HEAPS_PERCPU;
+        shared_heaps.n_heaps = system_info.n_cpus;
+    } else {
+        return;
+    }
+
+    n_pages = ALIGN(shared_heaps.n_heaps * (sizeof(heap_t) + sizeof(u32)), system_info.page_size)
+                >> system_info.log_2_page_size;
+
+    shared_heaps.heaps = get_pages_from_os(n_pages, system_info.page_size);
+
+    if (shared_heaps.heaps == NULL) {
+        LOG("could not get memory for shared heaps -- using thread heaps\n");
+        return;
+    }
+
+    /* Zeroed by mmap(). */
+    shared_heaps.n_misses = (u32*)(shared_heaps.heaps + shared_heaps.n_heaps);
+
+    for (i = 0; i < shared_heaps.n_heaps; i += 1) {
+        heap = shared_heaps.heaps + i;
+
+        heap_make(heap);
+        heap->__meta.tid    = i;
+        heap->__meta.flags |= HEAP_SHARED;
+
+        LOG("hid %d is a shared heap (idx = '%u')\n", heap->__meta.hid, i);
+    }
+
+    shared_heaps.mode = mode;
+
+    LOG("initialized %u %s\n",
+        shared_heaps.n_heaps,
+        mode == SHARED_HEAPS_ARENAS ? "arenas" : "per-CPU heaps");
+}
+
+internal heap_t * acquire_shared_heap_by_idx(u32 idx) {
+    heap_t *heap;
+
+    ASSERT(idx < shared_heaps.n_heaps, "invalid shared heap index");
+
+    heap = shared_heaps.heaps + idx;
+
+    HEAP_LOCK(heap);
+
+    return heap;
+}
+
+/*
+ * The thread may be moved to another CPU at any point, so the CPU
+ * is just a hint for which heap is least likely to be contended.
+ * The lock is what keeps the heap consistent.
+ */
+internal heap_t * acquire_percpu_heap(void) {
+    return acquire_shared_heap_by_idx(os_get_cpu() % shared_heaps.n_heaps);
+}
+
+internal u32 least_contended_arena(void) {
+    u32 best,
+        i;
+
+    best = 0;
+
+    for (i = 1; i < shared_heaps.n_heaps; i += 1) {
+        if (__atomic_load_n(&shared_heaps.n_misses[i],    __ATOMIC_RELAXED)
+        <   __atomic_load_n(&shared_heaps.n_misses[best], __ATOMIC_RELAXED)) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+internal heap_t * acquire_arena(void) {
+    heap_t *heap;
+    u32     idx;
+
+    if (unlikely(local_arena == 0)) {
+        idx         = __atomic_fetch_add(&shared_heaps.next_arena, 1, __ATOMIC_RELAXED)
+                        % shared_heaps.n_heaps;
+        local_arena = idx + 1;
+    }
+
+    idx  = local_arena - 1;
+    heap = shared_heaps.heaps + idx;
+
+    if (likely(lock_try_acquire(&heap->lock))) {
+        local_arena_misses = 0;
+        return heap;
+    }
+
+    __atomic_fetch_add(&shared_heaps.n_misses[idx], 1, __ATOMIC_RELAXED);
+
+    local_arena_misses += 1;
+
+    if (unlikely(local_arena_misses >= SHARED_HEAP_ARENA_MAX_MISSES)) {
+        idx                = least_contended_arena();
+        local_arena        = idx + 1;
+        local_arena_misses = 0;
+        heap               = shared_heaps.heaps + idx;
+
+        LOG("moving thread to arena %u\n", idx);
+    }
+
+    HEAP_LOCK(heap);
+
+    return heap;
+}
+
+internal heap_t * acquire_shared_heap(void) {
+    if (shared_heaps.mode == SHARED_HEAPS_ARENAS) {
+        return acquire_arena();
+    }
+
+    return acquire_percpu_heap();
+}
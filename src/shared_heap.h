@@ -0,0 +1,52 @@
+#ifndef __SHARED_HEAP_H__
+#define __SHARED_HEAP_H__
+
+#include "internal.h"
+#include "heap.h"
+
+/*
+ * Shared heaps are a fixed set of heaps that any thread can allocate
+ * from. When they are turned on, they replace thread heaps as the
+ * place that malloc() and friends get memory from, so the amount of
+ * heap metadata and partially used blocks scales with the number of
+ * shared heaps instead of with the number of threads.
+ *
+ * Unlike thread heaps, shared heaps are always locked.
+ * Blocks that belong to a shared heap are marked with HEAP_SHARED and
+ * store the heap's index in heap__meta.tid.
+ *
+ * HMALLOC_PERCPU_HEAPS=1 gives one shared heap per CPU and picks the
+ * heap for the CPU that the calling thread is running on.
+ *
+ * HMALLOC_ARENAS=<n> gives n arenas (4 per CPU if n isn't given).
+ * Threads are handed arenas round-robin and stay with theirs until
+ * they have found it locked SHARED_HEAP_ARENA_MAX_MISSES times in a
+ * row. Then they move to the arena that has been contended the least.
+ */
+
+#define SHARED_HEAPS_OFF    (0)
+#define SHARED_HEAPS_PERCPU (1)
+#define SHARED_HEAPS_ARENAS (2)
+
+#define SHARED_HEAP_ARENAS_PER_CPU   (4)
+#define SHARED_HEAP_ARENA_MAX_MISSES (8)
+
+typedef struct {
+    heap_t *heaps;
+    u32    *n_misses;
+    u32     n_heaps;
+    u32     mode;
+    u32     next_arena;
+} shared_heaps_t;
+
+internal shared_heaps_t shared_heaps;
+
+/* Arena index + 1 -- zero until this thread has been given one. */
+internal __thread u32 local_arena;
+internal __thread u32 local_arena_misses;
+
+internal void     shared_heaps_init(void);
+internal heap_t * acquire_shared_heap(void);
+internal heap_t * acquire_shared_heap_by_idx(u32 idx);
+
+#endif
@@ -0,0 +1,110 @@
+#include "internal.h"
+#include "small_heap.h"
+#include "os.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+internal void small_heaps_init(void) {
+    const char *slices_str;
+
+    ASSERT(SMALL_HEAP_SLICES_PER_BLOCK == 64, "small heap blocks must have 64 slices");
+
+    lock_init(&small_heaps.lock);
+
+    slices_str = getenv("HMALLOC_SMALL_HEAP_SLICES");
+
+    if (slices_str != NULL) {
+        hmalloc_small_heap_slices = strtoul(slices_str, NULL, 10);
+    }
+
+    LOG("user heaps use up to %u shared slices before getting their own blocks\n",
+        hmalloc_small_heap_slices);
+}
+
+internal void * small_heap_alloc_slice(void *ctx, size_t n_bytes, size_t alignment) {
+    small_heap_block_t *shared;
+    void               *slice;
+    u32                 i;
+
+    ASSERT(n_bytes == SMALL_HEAP_SLICE_SIZE, "small heap slices only come in one size");
+    ASSERT(alignment <= system_info.page_size, "small heap slices are only page aligned");
+
+    slice = NULL;
+
+    SMALL_HEAPS_LOCK(); {
+        for (shared = small_heaps.blocks; shared != NULL; shared = shared->next) {
+            if (shared->free_slices != 0)    { break; }
+        }
+
+        if (shared == NULL) {
+            shared = imalloc(sizeof(small_heap_block_t));
+
+            if (unlikely(shared == NULL))    { goto out; }
+
+            /* Aligned so that a slice can find its block by masking. */
+            shared->base = get_pages_from_os(DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size,
+                                             DEFAULT_BLOCK_SIZE);
+
+            if (unlikely(shared->base == NULL)) {
+                ifree(shared);
+                goto out;
+            }
+
+            shared->free_slices = SMALL_HEAP_ALL_SLICES_FREE;
+            shared->next        = small_heaps.blocks;
+            small_heaps.blocks  = shared;
+
+            LOG("new shared block for small heaps at %p\n", shared->base);
+        }
+
+        i                    = __builtin_ctzll(shared->free_slices);
+        shared->free_slices &= ~(1ULL << i);
+        slice                = shared->base + (i * SMALL_HEAP_SLICE_SIZE);
+out:;
+    } SMALL_HEAPS_UNLOCK();
+
+    return slice;
+}
+
+internal void small_heap_free_slice(void *ctx, void *addr, size_t n_bytes) {
+    small_heap_block_t  *shared,
+                       **prev;
+    void                *base;
+    u32                  i;
+
+    ASSERT(n_bytes == SMALL_HEAP_SLICE_SIZE, "small heap slices only come in one size");
+
+    /* The next heap to get this slice expects zeroed memory. */
+    madvise(addr, n_bytes, MADV_DONTNEED);
+
+    base = (void*)(((u64)addr) & ~(DEFAULT_BLOCK_SIZE - 1ULL));
+    i    = (addr - base) / SMALL_HEAP_SLICE_SIZE;
+
+    SMALL_HEAPS_LOCK(); {
+        for (prev = &small_heaps.blocks; (*prev)->base != base; prev = &(*prev)->next);
+
+        shared               = *prev;
+        shared->free_slices |= 1ULL << i;
+
+        if (shared->free_slices == SMALL_HEAP_ALL_SLICES_FREE
+        &&  (shared != small_heaps.blocks || shared->next != NULL)) {
+            *prev = shared->next;
+        } else {
+            shared = NULL;
+        }
+    } SMALL_HEAPS_UNLOCK();
+
+    if (shared != NULL) {
+        release_pages_to_os(shared->base, DEFAULT_BLOCK_SIZE >> system_info.log_2_page_size);
+        ifree(shared);
+    }
+}
+
+internal hmalloc_page_provider_t small_heap_provider = {
+    .alloc_pages = small_heap_alloc_slice,
+    .free_pages  = small_heap_free_slice,
+    .purge       = os_provider_purge,
+    .commit      = os_provider_commit,
+    .ctx         = NULL,
+};
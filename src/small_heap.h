@@ -0,0 +1,67 @@
+#ifndef __SMALL_HEAP_H__
+#define __SMALL_HEAP_H__
+
+#include "internal.h"
+#include "heap.h"
+#include "lock.h"
+
+/*
+ * Small heaps.
+ *
+ * The first allocation from a heap maps a DEFAULT_BLOCK_SIZE block,
+ * and asks for a spare one to go with it. With a user heap for every
+ * allocation site, thousands of heaps that each only ever hold a few
+ * kilobytes end up costing gigabytes of address space.
+ *
+ * So new user heaps start out small: their cblocks are
+ * SMALL_HEAP_SLICE_SIZE slices of blocks that all small heaps share,
+ * and they skip sblocks, putting small allocations in those cblocks
+ * too.
+ * To the heap, a slice is just a small cblock. It has its own block
+ * header, so the page map tags its pages with the heap that it
+ * belongs to, and it is allocated from, freed into and released like
+ * any other cblock. Slices come from (and go back to)
+ * small_heap_provider, so nothing else needs to know about them.
+ *
+ * Once a heap has taken hmalloc_small_heap_slices slices, it's
+ * promoted: from then on it gets blocks of its own from its page
+ * provider and uses sblocks like any other heap. The slices that it already has stay
+ * in use until they are emptied.
+ * Heaps with their own page provider or page attributes, or that use
+ * oblocks, never start out small.
+ *
+ * HMALLOC_SMALL_HEAP_SLICES=<n> sets the number of slices before a
+ * heap is promoted (0 turns small heaps off).
+ *
+ * The shared blocks are on one list, each with a bitmap of its free
+ * slices, under one lock. Freed slices are purged. A shared block
+ * whose slices are all free is given back unless it's the last one.
+ */
+
+#define SMALL_HEAP_SLICE_SIZE       (KiB(64))
+#define SMALL_HEAP_SLICES_PER_BLOCK (DEFAULT_BLOCK_SIZE / SMALL_HEAP_SLICE_SIZE)
+#define SMALL_HEAP_DEFAULT_SLICES   (8)
+#define SMALL_HEAP_ALL_SLICES_FREE  (0xFFFFFFFFFFFFFFFFULL)
+
+typedef struct small_heap_block {
+    struct small_heap_block *next;
+    void                    *base;
+    u64                      free_slices;
+} small_heap_block_t;
+
+typedef struct {
+    small_heap_block_t *blocks;
+    hmalloc_lock_t      lock;
+} small_heaps_t;
+
+internal small_heaps_t small_heaps;
+internal u32           hmalloc_small_heap_slices = SMALL_HEAP_DEFAULT_SLICES;
+
+#define SMALL_HEAPS_LOCK()   HMALLOC_LOCK_LOCKER(&small_heaps.lock)
+#define SMALL_HEAPS_UNLOCK() HMALLOC_LOCK_UNLOCKER(&small_heaps.lock)
+
+internal hmalloc_page_provider_t small_heap_provider;
+
+internal void small_heaps_init(void);
+
+#endif
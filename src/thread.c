@@ -3,42 +3,173 @@
 #include "heap.h"
 #include "os.h"
 #include "init.h"
+#include "shared_heap.h"
+#include "pool.h"
 
-internal hm_tid_t get_this_tid(void) { return OS_TID_TO_HM_TID(os_get_tid()); }
+#include <errno.h>
 
-internal void threads_init(void) {
-    int i;
+internal hm_tid_t get_this_tid(void) { return get_this_thread()->tid; }
+
+/*
+ * Find the segment in *slot, or create it.
+ * If another thread beats us to creating it, use theirs.
+ */
+internal void * get_or_make_segment(void **slot, u64 n_bytes) {
+    void *segment,
+         *new_segment;
+    u64   n_pages;
+
+    segment = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (likely(segment != NULL))    { return segment; }
+
+    n_pages     = ALIGN(n_bytes, system_info.page_size) >> system_info.log_2_page_size;
+    /* Zeroed by mmap(). */
+    new_segment = get_pages_from_os(n_pages, system_info.page_size);
 
-    for (i = 0; i < HMALLOC_MAX_THREADS; i += 1) {
-        pthread_mutex_init(&(thread_datas[i].mtx), NULL);
+    ASSERT(new_segment != NULL, "could not get memory for thread segment");
+
+    if (__atomic_compare_exchange_n(slot, &segment, new_segment, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return new_segment;
     }
 
+    release_pages_to_os(new_segment, n_pages);
+
+    return segment;
+}
+
+/* NULL if the slot's segment hasn't been created yet. */
+internal thread_data_t * thread_data_for_tid(hm_tid_t tid) {
+    thread_data_t *segment;
+
+    segment = __atomic_load_n(&thread_registry.segments[THREAD_SEGMENT(tid)], __ATOMIC_ACQUIRE);
+
+    if (unlikely(segment == NULL))    { return NULL; }
+
+    return segment + THREAD_SEGMENT_IDX(tid);
+}
+
+/*
+ * Give back everything that the heap isn't using and leave
+ * the rest for whichever thread or context adopts the slot next.
+ * Called by the slot's owner.
+ */
+internal void thread_orphan(thread_data_t *thr) {
+    heap_t *heap;
+
+    heap = &thr->heap;
+
+    epoch_thread_exit(&thr->epoch);
+
+    thread_heap_drain(heap);
+    heap_release_empty_blocks(heap);
+    release_this_thread_heap(heap);
+
+    thr->is_context = 0;
+
+    __atomic_store_n(&thr->state, THR_ORPHANED, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&thread_registry.n_orphans, 1, __ATOMIC_RELEASE);
+
+    LOG("tid %u is done -- hid %d is orphaned\n", thr->tid, heap->__meta.hid);
+}
+
+/* Runs when a thread that has a heap exits. */
+internal void thread_exit(void *arg) {
+    thread_orphan(arg);
+
+    /*
+     * Anything freed after this point (i.e. from later TSD
+     * destructors) goes through the remote free stack.
+     */
+    local_thr     = NULL;
+    local_own_thr = NULL;
+    local_ctx     = NULL;
+}
+
+internal void threads_init(void) {
+    int err;
+
+    err = pthread_key_create(&thread_exit_key, thread_exit);
+
+    ASSERT(err == 0, "could not create thread exit key");
+    (void)err;
+
     LOG("initialized threads\n");
 }
 
 internal void thread_init(thread_data_t *thr, hm_tid_t tid) {
     heap_make(&thr->heap);
     thr->tid                = tid;
+    thr->os_tid             = os_get_tid();
     thr->heap.__meta.tid    = tid;
     thr->heap.__meta.flags |= HEAP_THREAD;
-    thr->is_valid           = 1;
 
-    LOG("initialized a new thread with tid %hu\n", tid);
-    LOG("hid %d is a thread heap (tid = '%d')\n", thr->heap.__meta.hid, thr->tid);
+    __atomic_store_n(&thr->state, THR_ACTIVE, __ATOMIC_RELEASE);
+
+    LOG("initialized a new thread with tid %u\n", tid);
+    LOG("hid %d is a thread heap (tid = '%u')\n", thr->heap.__meta.hid, thr->tid);
 }
 
-internal thread_data_t * acquire_locally(void) {
-    THR_LOCK(local_thr);
-    return local_thr;
+/*
+ * Claim a heap that an exited thread left behind so that its
+ * partially used blocks get used again.
+ */
+internal thread_data_t * thread_adopt_orphan(void) {
+    thread_data_t *thr;
+    hm_tid_t       n_slots,
+                   tid;
+    int            state;
+
+    if (__atomic_load_n(&thread_registry.n_orphans, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+
+    n_slots = __atomic_load_n(&thread_registry.n_slots, __ATOMIC_ACQUIRE);
+
+    for (tid = 0; tid < n_slots; tid += 1) {
+        thr = thread_data_for_tid(tid);
+
+        if (thr == NULL)    { continue; }
+
+        state = THR_ORPHANED;
+
+        if (__atomic_load_n(&thr->state, __ATOMIC_RELAXED) == THR_ORPHANED
+        &&  __atomic_compare_exchange_n(&thr->state, &state, THR_ACTIVE,
+                                        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+
+            __atomic_fetch_sub(&thread_registry.n_orphans, 1, __ATOMIC_RELAXED);
+            thr->os_tid = os_get_tid();
+
+            LOG("adopted orphaned hid %d (tid = '%u')\n", thr->heap.__meta.hid, thr->tid);
+
+            return thr;
+        }
+    }
+
+    return NULL;
 }
 
-internal thread_data_t * acquire_this_thread(void) {
+internal thread_data_t * thread_new_slot(void) {
+    thread_data_t *segment;
     hm_tid_t       tid;
-    thread_data_t *thr;
-    int            count;
+    u64            seg;
+
+    tid = __atomic_fetch_add(&thread_registry.n_slots, 1, __ATOMIC_ACQ_REL);
+
+    ASSERT(tid < HMALLOC_MAX_THREADS, "exceeded HMALLOC_MAX_THREADS");
+
+    seg     = THREAD_SEGMENT(tid);
+    segment = get_or_make_segment((void**)&thread_registry.segments[seg],
+                                  THREAD_SEGMENT_LEN(seg) * sizeof(thread_data_t));
 
-    if (local_thr != NULL) {
-        return acquire_locally();
+    thread_init(segment + THREAD_SEGMENT_IDX(tid), tid);
+
+    return segment + THREAD_SEGMENT_IDX(tid);
+}
+
+internal thread_data_t * get_this_thread(void) {
+    if (likely(local_thr != NULL)) {
+        return local_thr;
     }
 
     /*
@@ -49,86 +180,583 @@ internal thread_data_t * acquire_this_thread(void) {
     /* Ensure our system is initialized. */
     hmalloc_init();
 
-    /*
-     * Starting point in the thread_datas array.
-     */
-    tid = get_this_tid();
-
-    THR_DATA_LOCK(); {
-        /*
-         * Walk through the thread_data slots until we find one that
-         * is vacant.
-         */
-        for (count = 0; count < HMALLOC_MAX_THREADS; count += 1) {
-            thr = thread_datas + tid;
-
-            if (!thr->is_valid) {
-                /*
-                 * Found one. Initialize it.
-                 */
-                thread_init(thr, tid);
-                local_thr = thr;
-                break;
-            }
+    local_thr = thread_adopt_orphan();
 
-            tid = (tid + 1) & (HMALLOC_MAX_THREADS - 1);
-        }
+    if (local_thr == NULL) {
+        local_thr = thread_new_slot();
+    }
 
-        ASSERT(count < HMALLOC_MAX_THREADS, "exceeded HMALLOC_MAX_THREADS");
-    } THR_DATA_UNLOCK();
+    local_own_thr = local_thr;
 
-    THR_LOCK(local_thr);
+    /*
+     * This may allocate, but local_thr is already set, so we
+     * won't come back through here.
+     */
+    pthread_setspecific(thread_exit_key, local_thr);
 
     return local_thr;
 }
 
-internal thread_data_t * acquire_thread(hm_tid_t tid) {
+/*
+ * Contexts.
+ *
+ * A context is a slot in the thread registry that isn't bound to an
+ * OS thread. Installing one makes it the calling thread's heap until
+ * it is switched out again, so a fiber that carries its context
+ * around keeps allocating from and freeing locally into the same heap
+ * no matter which thread it runs on.
+ *
+ * The owner-only rule for thread heaps still holds: the fiber
+ * scheduler must not have a context installed on two threads at
+ * once, and its own hand off between threads orders our accesses.
+ */
+
+external hmalloc_context_t * hmalloc_context_create(void) {
     thread_data_t *thr;
 
     /* Ensure our system is initialized. */
     hmalloc_init();
 
-    thr = thread_datas + tid;
+    thr = thread_adopt_orphan();
+
+    if (thr == NULL) {
+        thr = thread_new_slot();
+    }
+
+    thr->is_context = 1;
+
+    LOG("tid %u is a context\n", thr->tid);
 
-    THR_LOCK(thr);
+    return (hmalloc_context_t*)thr;
+}
+
+external void hmalloc_context_destroy(hmalloc_context_t *ctx) {
+    thread_data_t *thr;
 
-    ASSERT(thr->is_valid, "invalid thread_data");
+    thr = (thread_data_t*)ctx;
 
-    return thr;
+    if (thr == NULL)    { return; }
+
+    ASSERT(thr->is_context, "destroying something that isn't a context");
+    ASSERT(thr != local_ctx, "destroying the installed context");
+
+    thread_orphan(thr);
 }
 
-internal void release_thread(thread_data_t *thr) {
-    THR_UNLOCK(thr);
+external hmalloc_context_t * hmalloc_context_switch(hmalloc_context_t *ctx) {
+    thread_data_t *prev;
+
+    prev      = local_ctx;
+    local_ctx = (thread_data_t*)ctx;
+    local_thr = ctx ? (thread_data_t*)ctx : local_own_thr;
+
+    return (hmalloc_context_t*)prev;
 }
 
-internal heap_t * acquire_this_thread_heap(void) {
+/*
+ * Ownership migration.
+ *
+ * In producer/consumer code, most of the frees of a block can come
+ * from one other thread. Each of those is a remote free that the
+ * owner has to drain. The owner counts, per block, how many of the
+ * last BLOCK_MIGRATE_WINDOW frees were remote. When at least
+ * BLOCK_MIGRATE_MIN_REMOTE of them were, the block is handed over
+ * to the heap of the thread that freed into it last. That thread's
+ * frees become local and the space goes where it is being released.
+ *
+ * The handover goes through the new owner's incoming_blocks stack.
+ * The block is pushed there before its heap__meta.tid is switched,
+ * so a thread that sees itself as a block's owner can always find
+ * the block by draining its incoming stack first. Frees that were
+ * sent to the old owner before the switch are forwarded when it
+ * drains them.
+ */
+
+internal void thread_heap_adopt_incoming(heap_t *heap) {
+    block_header_t *block,
+                   *next;
+
+    block = __atomic_exchange_n(&heap->incoming_blocks, NULL, __ATOMIC_ACQUIRE);
+
+    while (block != NULL) {
+        next                  = block->next_incoming;
+        block->next_incoming  = NULL;
+        block->n_frees        = 0;
+        block->n_remote_frees = 0;
+
+        if (block->block_kind == BLOCK_KIND_OBLOCK) {
+            block->o.prev = NULL;
+            heap_add_oblock(heap, &(block->o));
+#ifdef HMALLOC_USE_SBLOCKS
+        } else if (block->block_kind == BLOCK_KIND_SBLOCK) {
+            block->s.prev = NULL;
+            heap_add_sblock(heap, &(block->s));
+#endif
+        } else {
+            block->c.prev = NULL;
+            heap_add_cblock(heap, &(block->c));
+        }
+
+        block = next;
+    }
+}
+
+internal void thread_heap_hand_off(heap_t *heap, block_header_t *block, heap_t *to) {
+    block_header_t *head;
+
+    if (block->block_kind == BLOCK_KIND_OBLOCK) {
+        heap_remove_oblock(heap, &(block->o));
+#ifdef HMALLOC_USE_SBLOCKS
+    } else if (block->block_kind == BLOCK_KIND_SBLOCK) {
+        heap_remove_sblock(heap, &(block->s));
+#endif
+    } else {
+        heap_remove_cblock(heap, &(block->c));
+    }
+
+    block->heap__meta.hid = to->__meta.hid;
+    block->heap           = to;
+
+    head = __atomic_load_n(&to->incoming_blocks, __ATOMIC_RELAXED);
+
+    do {
+        block->next_incoming = head;
+    } while (!__atomic_compare_exchange_n(&to->incoming_blocks, &head, block,
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_store_n(&block->heap__meta.tid, to->__meta.tid, __ATOMIC_RELEASE);
+
+    LOG("handed a block from hid %d to hid %d\n", heap->__meta.hid, to->__meta.hid);
+}
+
+internal heap_t * thread_heap_migration_target(heap_t *heap, block_header_t *block) {
     thread_data_t *thr;
-    heap_t        *heap;
+    u32            hint;
 
-    thr  = acquire_this_thread();
-    heap = &thr->heap;
+    hint = __atomic_load_n(&block->last_remote_tid, __ATOMIC_RELAXED);
 
-    HEAP_LOCK(heap);
+    if (hint == 0 || hint - 1 == heap->__meta.tid)    { return NULL; }
+
+    thr = thread_data_for_tid(hint - 1);
+
+    if (thr == NULL
+    ||  __atomic_load_n(&thr->state, __ATOMIC_ACQUIRE) != THR_ACTIVE) {
+        return NULL;
+    }
+
+    return &thr->heap;
+}
+
+internal int thread_heap_block_is_pinned(heap_t *heap, block_header_t *block, void *addr) {
+    if (block->block_kind == BLOCK_KIND_OBLOCK) {
+        return &(block->o) == heap->oblocks_tail;
+#ifdef HMALLOC_USE_SBLOCKS
+    } else if (block->block_kind == BLOCK_KIND_SBLOCK) {
+        return &(block->s) == heap->sblocks_tail;
+#endif
+    }
+
+    return (CHUNK_FROM_USER_MEM(addr)->flags & CHUNK_IS_BIG)
+        || &(block->c) == heap->cblocks_tail;
+}
+
+/*
+ * Called by the owner for every free into one of its blocks.
+ * The caller has seen our tid in the block, but the block may have
+ * been handed to us after we last drained incoming_blocks, so it
+ * might not be on our lists yet.
+ */
+internal void thread_heap_owner_free(heap_t *heap, block_header_t *block, void *addr, int is_remote) {
+    heap_t *to;
+
+    if (unlikely(__atomic_load_n(&heap->incoming_blocks, __ATOMIC_RELAXED) != NULL)) {
+        thread_heap_adopt_incoming(heap);
+    }
+
+    /*
+     * Blocks for big chunks aren't on any list and don't move.
+     * Neither does the block that we're currently allocating from.
+     */
+    if (unlikely(thread_heap_block_is_pinned(heap, block, addr))) {
+        heap_free(heap, block, addr);
+        return;
+    }
+
+    block->n_frees        += 1;
+    block->n_remote_frees += is_remote;
+
+    if (unlikely(block->n_frees >= BLOCK_MIGRATE_WINDOW)) {
+        to = NULL;
+
+        if (block->n_remote_frees >= BLOCK_MIGRATE_MIN_REMOTE) {
+            to = thread_heap_migration_target(heap, block);
+        }
+
+        block->n_frees        = 0;
+        block->n_remote_frees = 0;
+
+        if (to != NULL) {
+            thread_heap_hand_off(heap, block, to);
+            /* Let the new owner do this free. */
+            heap_push_remote_free(to, block, addr);
+            return;
+        }
+    }
+
+    heap_free(heap, block, addr);
+}
+
+/*
+ * Called by the heap's owner.
+ * Free the oblock memory that other threads have queued for us.
+ * A node whose block has been handed off since is passed on as it
+ * is.
+ */
+internal void thread_heap_drain_oblock_frees(heap_t *heap) {
+    remote_free_node_t *node,
+                       *next;
+    block_header_t     *block;
+    hm_tid_t            owner;
+
+    node = __atomic_exchange_n(&heap->remote_oblock_frees, NULL, __ATOMIC_ACQUIRE);
+
+    while (node != NULL) {
+        next  = node->next;
+        block = ADDR_PARENT_BLOCK(node->addr);
+
+        ASSERT(block != NULL, "remote free of address with no block");
+
+        owner = __atomic_load_n(&block->heap__meta.tid, __ATOMIC_ACQUIRE);
+
+        if (unlikely(owner != heap->__meta.tid)) {
+            heap_push_remote_oblock_node(&thread_data_for_tid(owner)->heap, node);
+        } else {
+            thread_heap_owner_free(heap, block, node->addr, 1);
+            ifree(node);
+        }
+
+        node = next;
+    }
+}
+
+/*
+ * Called by the heap's owner.
+ * Take in blocks handed to us and free everything that other
+ * threads have pushed so far.
+ */
+internal void thread_heap_drain(heap_t *heap) {
+    void           *addr,
+                   *next;
+    block_header_t *block;
+    hm_tid_t        owner;
+
+    if (unlikely(__atomic_load_n(&heap->incoming_blocks, __ATOMIC_RELAXED) != NULL)) {
+        thread_heap_adopt_incoming(heap);
+    }
+
+    if (unlikely(__atomic_load_n(&heap->remote_oblock_frees, __ATOMIC_RELAXED) != NULL)) {
+        thread_heap_drain_oblock_frees(heap);
+    }
+
+    if (likely(__atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED) == NULL)) {
+        return;
+    }
+
+    addr = __atomic_exchange_n(&heap->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+    while (addr != NULL) {
+        next  = *(void**)addr;
+        block = ADDR_PARENT_BLOCK(addr);
+
+        ASSERT(block != NULL, "remote free of address with no block");
 
-    release_thread(thr);
+        owner = __atomic_load_n(&block->heap__meta.tid, __ATOMIC_ACQUIRE);
+
+        if (unlikely(owner != heap->__meta.tid)) {
+            /* The block was handed off since this was pushed. */
+            heap_push_remote_free(&thread_data_for_tid(owner)->heap, block, addr);
+        } else {
+            thread_heap_owner_free(heap, block, addr, 1);
+        }
+
+        addr = next;
+    }
+}
+
+/*
+ * Only the owning thread ever uses its heap, so there's nothing
+ * to lock here. We just pick up anything that other threads have
+ * handed back to us in the meantime.
+ */
+internal heap_t * acquire_this_thread_heap(void) {
+    heap_t *heap;
+
+    heap = &get_this_thread()->heap;
+
+    thread_heap_drain(heap);
 
     return heap;
 }
 
-internal heap_t * acquire_thread_heap(hm_tid_t tid) {
-    thread_data_t *thr;
-    heap_t        *heap;
+internal void release_this_thread_heap(heap_t *heap) {
+    deferred_release_t *releases;
 
-    thr  = acquire_thread(tid);
-    heap = &thr->heap;
+    if (likely(heap->deferred_releases == NULL)) {
+        return;
+    }
 
-    HEAP_LOCK(heap);
+    releases                = heap->deferred_releases;
+    heap->deferred_releases = NULL;
+
+    /* Thread heaps don't keep a spare block (see heap_get_block_pages()). */
+    heap_finish_unlocked(heap, releases, 0);
+}
+
+/*
+ * Remember the last thread to free into a block from outside so that
+ * the block can be handed to it.
+ */
+internal void thread_heap_note_remote_free(block_header_t *block) {
+    if (local_thr != NULL
+    &&  __atomic_load_n(&block->last_remote_tid, __ATOMIC_RELAXED) != local_thr->tid + 1) {
+        __atomic_store_n(&block->last_remote_tid, local_thr->tid + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Free addr from the thread heap that block belongs to.
+ * The owner frees directly. Everyone else hands the address
+ * to the owner through its remote free stack.
+ */
+internal void thread_heap_free(block_header_t *block, void *addr) {
+    heap_t   *heap;
+    hm_tid_t  owner;
+
+    owner = __atomic_load_n(&block->heap__meta.tid, __ATOMIC_ACQUIRE);
+
+    if (likely(local_thr != NULL
+    &&         local_thr->tid == owner)) {
+        heap = &local_thr->heap;
+
+        thread_heap_owner_free(heap, block, addr, 0);
+        release_this_thread_heap(heap);
+    } else {
+        thread_heap_note_remote_free(block);
+        heap_push_remote_free(&thread_data_for_tid(owner)->heap, block, addr);
+    }
+}
+
+/*
+ * Free n_addrs addresses at once.
+ * Frees into our own heap are done directly, consecutive frees to
+ * the same other thread are pushed to it as one list, and a locked
+ * heap stays locked for as long as the frees keep going to it.
+ */
+internal void free_addrs(void **addrs, u64 n_addrs) {
+    heap_t         *own,
+                   *locked;
+    block_header_t *block;
+    void           *addr,
+                   *run_first,
+                   *run_last;
+    hm_tid_t        run_owner,
+                    owner;
+    u64             i;
+
+    if (unlikely(hmalloc_ignore_frees))    { return; }
+
+    own       = acquire_this_thread_heap();
+    locked    = NULL;
+    run_first = run_last = NULL;
+    run_owner = 0;
+
+    for (i = 0; i < n_addrs; i += 1) {
+        addr  = addrs[i];
+        block = ADDR_PARENT_BLOCK(addr);
+
+        if (unlikely(block == NULL)) {
+            LOG("ignoring free of foreign pointer %p\n", addr);
+            continue;
+        }
+
+        if (likely(block->heap__meta.flags & HEAP_THREAD)) {
+            owner = __atomic_load_n(&block->heap__meta.tid, __ATOMIC_ACQUIRE);
+
+            if (owner == own->__meta.tid) {
+                thread_heap_owner_free(own, block, addr, 0);
+                continue;
+            }
+
+            thread_heap_note_remote_free(block);
+
+            /* oblock memory can't be linked into the run. */
+            if (unlikely(block->block_kind == BLOCK_KIND_OBLOCK)) {
+                heap_push_remote_free(&thread_data_for_tid(owner)->heap, block, addr);
+                continue;
+            }
+
+            if (run_first != NULL && owner != run_owner) {
+                heap_push_remote_frees(&thread_data_for_tid(run_owner)->heap, run_first, run_last);
+                run_first = NULL;
+            }
 
-    release_thread(thr);
+            if (run_first == NULL) {
+                run_last  = addr;
+                run_owner = owner;
+            }
+
+            *(void**)addr = run_first;
+            run_first     = addr;
+
+            continue;
+        }
+
+        if (unlikely(block->heap__meta.flags & HEAP_BUMP))    { continue; }
+
+        if (block->heap__meta.flags & HEAP_POOL) {
+            pool_free((pool_t*)block->heap, block, addr);
+            continue;
+        }
+
+        if (locked != NULL && locked != block->heap) {
+            release_heap(locked);
+            locked = NULL;
+        }
+
+        if (locked == NULL) {
+            locked = block->heap;
+            HEAP_LOCK(locked);
+        }
+
+        heap_free(locked, block, addr);
+    }
+
+    if (run_first != NULL) {
+        heap_push_remote_frees(&thread_data_for_tid(run_owner)->heap, run_first, run_last);
+    }
+
+    if (locked != NULL) {
+        release_heap(locked);
+    }
+
+    release_this_thread_heap(own);
+}
+
+/*
+ * The heap that malloc() and friends should use for this thread:
+ * a pushed user heap, the installed context's heap, its own thread
+ * heap, or a locked shared heap if those are on.
+ */
+internal heap_t * acquire_default_heap(void) {
+    if (unlikely(local_default_heap != NULL)) {
+        return acquire_user_heap_object(local_default_heap);
+    }
+
+    if (unlikely(shared_heaps.mode != SHARED_HEAPS_OFF && local_ctx == NULL)) {
+        return acquire_shared_heap();
+    }
+
+    return acquire_this_thread_heap();
+}
+
+internal void release_default_heap(heap_t *heap) {
+    if (unlikely(!(heap->__meta.flags & HEAP_THREAD))) {
+        release_heap(heap);
+    } else {
+        release_this_thread_heap(heap);
+    }
+}
+
+/*
+ * The handle is resolved to its heap when it is pushed so that
+ * allocating doesn't have to go through the user heap table.
+ */
+external int hmalloc_push_default_heap(heap_handle_t h) {
+    heap_t *heap;
+
+    if (unlikely(local_default_heap_depth == DEFAULT_HEAP_STACK_DEPTH)) {
+        return EOVERFLOW;
+    }
+
+    heap = NULL;
+
+    if (h != NULL) {
+        /* Ensure our system is initialized. */
+        hmalloc_init();
+
+        heap = get_or_make_user_heap(h);
+
+        if (unlikely(heap == NULL))    { return ENOMEM; }
+    }
+
+    local_default_heap_stack[local_default_heap_depth]  = heap;
+    local_default_heap_depth                           += 1;
+    local_default_heap                                  = heap;
+
+    return 0;
+}
+
+external void hmalloc_pop_default_heap(void) {
+    ASSERT(local_default_heap_depth > 0, "default heap stack underflow");
+
+    if (unlikely(local_default_heap_depth == 0))    { return; }
+
+    local_default_heap_depth -= 1;
+    local_default_heap        = local_default_heap_depth
+                                    ? local_default_heap_stack[local_default_heap_depth - 1]
+                                    : NULL;
+}
+
+/*
+ * Count a contended acquisition of an unsplit user heap.
+ * Returns whether it was the one that makes the heap worth
+ * splitting. The counters are updated without the lock, so this is
+ * only approximate, which is all it needs to be.
+ */
+internal int user_heap_note_contention(user_heap_t *uh) {
+    u64 now;
+
+    now = lock_now_ns();
+
+    if (now - __atomic_load_n(&uh->contended_since, __ATOMIC_RELAXED) > USER_HEAP_SHARD_WINDOW_NS) {
+        __atomic_store_n(&uh->contended_since, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&uh->n_contended, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return __atomic_add_fetch(&uh->n_contended, 1, __ATOMIC_RELAXED) == USER_HEAP_SHARD_AFTER_CONTENDED;
+}
+
+/*
+ * Lock the heap that an allocation from user heap heap should come
+ * from: the heap itself or, if it has been split, the shard for
+ * the current CPU.
+ */
+internal heap_t * acquire_user_heap_object(heap_t *heap) {
+    user_heap_t *uh;
+    heap_t      *shards;
+
+    uh     = (user_heap_t*)heap;
+    shards = __atomic_load_n(&uh->shards, __ATOMIC_ACQUIRE);
+
+    if (shards != NULL) {
+        heap = shards + (os_get_cpu() % uh->n_shards);
+    }
+
+    if (likely(lock_try_acquire(&heap->lock)))    { return heap; }
+
+    if (shards == NULL
+    &&  system_info.n_cpus > 1
+    &&  user_heap_note_contention(uh)) {
+        make_user_heap_shards(uh);
+    }
+
+    HEAP_LOCK(heap);
 
     return heap;
 }
 
+/* Returns NULL if the heap doesn't exist and can't be made. */
 internal heap_t * acquire_user_heap(heap_handle_t handle) {
     heap_t *heap;
 
@@ -137,11 +765,119 @@ internal heap_t * acquire_user_heap(heap_handle_t handle) {
 
     heap = get_or_make_user_heap(handle);
 
-    HEAP_LOCK(heap);
+    if (unlikely(heap == NULL))    { return NULL; }
 
-    return heap;
+    return acquire_user_heap_object(heap);
 }
 
 internal void release_heap(heap_t *heap) {
+    deferred_release_t *releases;
+    u32                 wants_spare;
+
+    /*
+     * Take the work that needs a trip to the OS with us so that
+     * it happens outside of the heap's critical section.
+     */
+    releases                = heap->deferred_releases;
+    wants_spare             = heap->wants_spare;
+    heap->deferred_releases = NULL;
+    heap->wants_spare       = 0;
+
     HEAP_UNLOCK(heap);
+
+    if (unlikely(releases != NULL || wants_spare)) {
+        heap_finish_unlocked(heap, releases, wants_spare);
+    }
+}
+
+internal void heap_get_stats(heap_t *heap, hmalloc_heap_stats_t *stats) {
+    user_heap_t *uh;
+    heap_t      *shards;
+    u32          i;
+
+    stats->handle      = NULL;
+    stats->kind        = heap->__meta.flags & (HEAP_THREAD | HEAP_USER | HEAP_SHARED);
+    stats->id          = 0;
+    stats->n_acquires  = __atomic_load_n(&heap->lock.n_acquires,  __ATOMIC_RELAXED);
+    stats->n_contended = __atomic_load_n(&heap->lock.n_contended, __ATOMIC_RELAXED);
+    stats->wait_ns     = __atomic_load_n(&heap->lock.wait_ns,     __ATOMIC_RELAXED);
+    stats->n_os_allocs = __atomic_load_n(&heap->n_os_allocs,      __ATOMIC_RELAXED);
+
+    if (heap->__meta.flags & HEAP_USER) {
+        stats->handle = heap->__meta.handle;
+
+        uh     = (user_heap_t*)heap;
+        shards = __atomic_load_n(&uh->shards, __ATOMIC_ACQUIRE);
+
+        for (i = 0; shards != NULL && i < uh->n_shards; i += 1) {
+            stats->n_acquires  += __atomic_load_n(&shards[i].lock.n_acquires,  __ATOMIC_RELAXED);
+            stats->n_contended += __atomic_load_n(&shards[i].lock.n_contended, __ATOMIC_RELAXED);
+            stats->wait_ns     += __atomic_load_n(&shards[i].lock.wait_ns,     __ATOMIC_RELAXED);
+            stats->n_os_allocs += __atomic_load_n(&shards[i].n_os_allocs,      __ATOMIC_RELAXED);
+        }
+    } else {
+        stats->id     = heap->__meta.tid;
+    }
+}
+
+external size_t hmalloc_get_heap_stats(hmalloc_heap_stats_t *stats, size_t max_stats) {
+    thread_data_t *thr;
+    heap_t        *heap;
+    hm_tid_t       n_slots,
+                   tid;
+    size_t         n;
+    u32            i;
+
+    /* Ensure our system is initialized. */
+    hmalloc_init();
+
+    n       = 0;
+    n_slots = __atomic_load_n(&thread_registry.n_slots, __ATOMIC_ACQUIRE);
+
+    for (tid = 0; tid < n_slots; tid += 1) {
+        thr = thread_data_for_tid(tid);
+        if (thr != NULL
+        &&  __atomic_load_n(&thr->state, __ATOMIC_ACQUIRE) != THR_VACANT) {
+            if (n < max_stats)    { heap_get_stats(&thr->heap, stats + n); }
+            n += 1;
+        }
+    }
+
+    if (shared_heaps.mode != SHARED_HEAPS_OFF) {
+        for (i = 0; i < shared_heaps.n_heaps; i += 1) {
+            if (n < max_stats)    { heap_get_stats(shared_heaps.heaps + i, stats + n); }
+            n += 1;
+        }
+    }
+
+    USER_HEAPS_TRAVERSE(heap) {
+        if (n < max_stats)    { heap_get_stats(heap, stats + n); }
+        n += 1;
+    }
+
+    return n;
+}
+
+#ifdef HMALLOC_DO_LOGGING
+internal void heaps_log_stats(void) {
+    thread_data_t *thr;
+    heap_t        *heap;
+    hm_tid_t       n_slots,
+                   tid;
+
+    n_slots = __atomic_load_n(&thread_registry.n_slots, __ATOMIC_ACQUIRE);
+
+    for (tid = 0; tid < n_slots; tid += 1) {
+        thr = thread_data_for_tid(tid);
+        if (thr != NULL && thr->state != THR_VACANT) {
+            LOG("hid %d (thread %u) went to the OS %llu times while locked\n",
+                thr->heap.__meta.hid, thr->tid, thr->heap.n_os_allocs);
+        }
+    }
+
+    USER_HEAPS_TRAVERSE(heap) {
+        LOG("hid %d (user heap '%s') went to the OS %llu times while locked\n",
+            heap->__meta.hid, heap->__meta.handle, heap->n_os_allocs);
+    }
 }
+#endif
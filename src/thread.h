@@ -3,72 +3,114 @@
 
 #include "internal.h"
 #include "heap.h"
+#include "epoch.h"
 
 #include <pthread.h>
 
 
 /*
- * @TODO
+ * Threads are numbered in the order that they first use hmalloc
+ * (slots left behind by exited threads are reused first) and the
+ * number is cached in local_thr, so finding the current thread
+ * never needs a system call.
  *
- * HMALLOC_MAX_THREADS should be something that's configured
- * at run time -- either through an environment variable,
- * or computed on initialization by checking the number of
- * threads on the system.
- *                                                -- Brandon
+ * thread_data_t slots live in segments that are created on demand
+ * and never freed. Segment k holds THREAD_SEGMENT_BASE << k slots,
+ * so a handful of segments cover every 32-bit thread id and the
+ * first ones stay small for programs with only a few threads.
+ * Lookups don't take any locks.
  */
 
+typedef u32 hm_tid_t;
 
-#ifndef HMALLOC_MAX_THREADS
-#define HMALLOC_MAX_THREADS (512ULL)
-#endif
+#define LOG_2_THREAD_SEGMENT_BASE (6ULL)
+#define THREAD_SEGMENT_BASE       (1ULL << LOG_2_THREAD_SEGMENT_BASE)
+#define THREAD_N_SEGMENTS         (32ULL - LOG_2_THREAD_SEGMENT_BASE)
 
-#if HMALLOC_MAX_THREADS > (1 << 16)
-    #error "Can't represent this many threads."
-#endif
+#define THREAD_SEGMENT_LEN(seg) (THREAD_SEGMENT_BASE << (seg))
+#define THREAD_SEGMENT(tid)     ((u64)(63 - __builtin_clzll((u64)(tid) + THREAD_SEGMENT_BASE)) \
+                                    - LOG_2_THREAD_SEGMENT_BASE)
+#define THREAD_SEGMENT_IDX(tid) (((u64)(tid) + THREAD_SEGMENT_BASE) \
+                                    - THREAD_SEGMENT_LEN(THREAD_SEGMENT(tid)))
 
-#if !IS_POWER_OF_TWO_PP(HMALLOC_MAX_THREADS)
-    #error "HMALLOC_MAX_THREADS must be a power of two!"
-#endif
+#define HMALLOC_MAX_THREADS (UINT32_MAX - THREAD_SEGMENT_BASE)
 
-#define LOG_2_HMALLOC_MAX_THREADS (LOG2_64BIT(HMALLOC_MAX_THREADS))
+/*
+ * A slot is orphaned when its thread has exited. The heap still
+ * holds the blocks that have live allocations in them and is
+ * adopted by the next thread that needs a slot.
+ */
+#define THR_VACANT   (0)
+#define THR_ACTIVE   (1)
+#define THR_ORPHANED (2)
 
-typedef u16 hm_tid_t;
+/* A block migrates when MIN_REMOTE of its last WINDOW frees were remote. */
+#define BLOCK_MIGRATE_WINDOW     (64)
+#define BLOCK_MIGRATE_MIN_REMOTE (48)
 
 typedef struct {
     heap_t           heap;
     hm_tid_t         tid;
-    pthread_mutex_t  mtx;
-    int              is_valid;
+    pid_t            os_tid;
+    int              state;
+    int              is_context;
+    epoch_local_t    epoch;
     char            *cur_allocating_site;
 } thread_data_t;
 
-internal thread_data_t   thread_datas[HMALLOC_MAX_THREADS];
-internal pthread_mutex_t thread_datas_mtx = PTHREAD_MUTEX_INITIALIZER;
+typedef struct {
+    thread_data_t *segments[THREAD_N_SEGMENTS];
+    u32            n_slots;
+    u32            n_orphans;
+} thread_registry_t;
+
+internal thread_registry_t thread_registry;
 
+/*
+ * local_thr is the slot whose heap this thread is using right now.
+ * That is the thread's own slot (local_own_thr) unless a context
+ * (local_ctx) has been installed with hmalloc_context_switch().
+ */
 internal __thread thread_data_t *local_thr;
+internal __thread thread_data_t *local_own_thr;
+internal __thread thread_data_t *local_ctx;
+internal pthread_key_t           thread_exit_key;
+
+/*
+ * Stack of user heaps pushed with hmalloc_push_default_heap().
+ * local_default_heap caches the top so that the malloc() path only
+ * has to test one pointer. A NULL entry means "no override".
+ */
+#define DEFAULT_HEAP_STACK_DEPTH (32)
+
+internal __thread heap_t *local_default_heap_stack[DEFAULT_HEAP_STACK_DEPTH];
+internal __thread u32     local_default_heap_depth;
+internal __thread heap_t *local_default_heap;
 
 internal void threads_init(void);
 internal void thread_init(thread_data_t *thr, hm_tid_t tid);
-internal thread_data_t * acquire_this_thread(void);
-internal thread_data_t * acquire_thread(hm_tid_t tid);
-internal void release_thread(thread_data_t *thr);
+internal thread_data_t * get_this_thread(void);
+internal thread_data_t * thread_data_for_tid(hm_tid_t tid);
+internal void * get_or_make_segment(void **slot, u64 n_bytes);
 
+internal void thread_heap_drain(heap_t *heap);
 internal heap_t * acquire_this_thread_heap(void);
-internal heap_t * acquire_thread_heap(hm_tid_t tid);
+internal void release_this_thread_heap(heap_t *heap);
+internal void thread_heap_free(block_header_t *block, void *addr);
+internal void free_addrs(void **addrs, u64 n_addrs);
+internal heap_t * acquire_default_heap(void);
+internal void release_default_heap(heap_t *heap);
 internal heap_t * acquire_user_heap(heap_handle_t handle);
+internal heap_t * acquire_user_heap_object(heap_t *heap);
 internal void release_heap(heap_t *heap);
 
 internal hm_tid_t get_this_tid(void);
 
-#define HEAP_LOCK(heap_ptr)   HMALLOC_MTX_LOCKER(&heap_ptr->mtx)
-#define HEAP_UNLOCK(heap_ptr) HMALLOC_MTX_UNLOCKER(&heap_ptr->mtx)
-
-#define THR_LOCK(thr_ptr)   HMALLOC_MTX_LOCKER(&thr_ptr->mtx)
-#define THR_UNLOCK(thr_ptr) HMALLOC_MTX_UNLOCKER(&thr_ptr->mtx)
-
-#define THR_DATA_LOCK(thr_ptr)   HMALLOC_MTX_LOCKER(&thread_datas_mtx)
-#define THR_DATA_UNLOCK(thr_ptr) HMALLOC_MTX_UNLOCKER(&thread_datas_mtx)
+#ifdef HMALLOC_DO_LOGGING
+internal void heaps_log_stats(void);
+#endif
 
-#define OS_TID_TO_HM_TID(os_tid) ((os_tid) & (HMALLOC_MAX_THREADS - 1))
+#define HEAP_LOCK(heap_ptr)   HMALLOC_LOCK_LOCKER(&heap_ptr->lock)
+#define HEAP_UNLOCK(heap_ptr) HMALLOC_LOCK_UNLOCKER(&heap_ptr->lock)
 
 #endif